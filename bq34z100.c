@@ -30,14 +30,43 @@
 #include <linux/param.h>
 #include <linux/jiffies.h>
 #include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/cpumask.h>
+#include <linux/timer.h>
 #include <linux/delay.h>
 #include <linux/platform_device.h>
 #include <linux/power_supply.h>
 #include <linux/idr.h>
 #include <linux/i2c.h>
 #include <linux/slab.h>
+#include <linux/notifier.h>
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <linux/firmware.h>
+#include <linux/kobject.h>
+#include <linux/of.h>
+#include <linux/completion.h>
+#include <linux/rwsem.h>
+#include <linux/pm_runtime.h>
+#include <linux/vmalloc.h>
+#include <linux/crc32.h>
+#include <linux/seq_file.h>
+#include <linux/rcupdate.h>
+#include <linux/fault-inject.h>
+#include <linux/random.h>
+#include <linux/ktime.h>
+#include <linux/iio/iio.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/kfifo_buf.h>
+#include <net/genetlink.h>
+#include <linux/ctype.h>
+#include <linux/stddef.h>
 #include <asm/unaligned.h>
 
+#include "bq34z100.h"
+
 
 #define DRIVER_VERSION			"1.2.0"
 
@@ -59,6 +88,7 @@
 #define BQ27x00_REG_CHEML		0x79 /* 0X79 Device Chemistry Length */
 #define BQ27x00_REG_CHEM		0x7A /*0X7A - 0X7D Device Chemistry */
 #define BQ27x00_REG_SERNUM		0x7E /*Serial Number */
+#define BQ27x00_IDENT_LEN		(BQ27x00_REG_SERNUM + 2 - BQ27x00_REG_DATE)
 
 
 /*extended commands*/
@@ -83,6 +113,16 @@
 #define BQ27x00_REG_PCHG		0x34 /*PassedCharge */
 #define BQ27x00_REG_DCAP		0x3C /* Design capacity */
 
+/* largest block read of standard commands any chip needs per update */
+#define BQ27x00_SNAP_MAX		64
+/* longest head of that block read again to check the cut */
+#define BQ27x00_CUT_MAX		12
+#define BQ27x00_REG_DFCLS		0x3E /*DataFlashClass() */
+#define BQ27x00_REG_DFBLK		0x3F /*DataFlashBlock() */
+#define BQ27x00_REG_DFD			0x40 /*BlockData() 0x40 - 0x5F */
+#define BQ27x00_REG_DFDCKS		0x60 /*BlockDataChecksum() */
+#define BQ27x00_REG_DFDCNTL		0x61 /*BlockDataControl() */
+
 /* flags bit definitions */
 #define BQ27x00_FLAG_DSG			BIT(0) /* Discharging detected. True when set. */
 #define BQ27x00_FLAG_SOCF			BIT(1) /* State-of-Charge Threshold Final reached. True when set. */
@@ -97,63 +137,457 @@
 #define BQ27x00_FLAG_BATHIGH			BIT(13) /* Battery High bit that indicates a high battery voltage condition. */
 #define BQ27x00_FLAG_OTD			BIT(14) /* Over-Temperature in Discharge condition is detected. True when set. */
 #define BQ27x00_FLAG_OTC			BIT(15) /* Over-Temperature in Charge condition is detected. True when set. */
+#define BQ27x00_FLAG_CI			BIT(4) /* bq27000 Capacity Inaccurate, reserved on the others */
+
+/* older chips, see bq34z100.c-backup */
+#define BQ27000_REG_TEMP		0x06
+#define BQ27000_REG_VOLT		0x08
+#define BQ27000_REG_FLAGS		0x0A /* single byte */
+#define BQ27000_REG_RSOC		0x0B /* Relative State-of-Charge */
+#define BQ27000_REG_NAC			0x0C
+#define BQ27000_REG_LMD			0x12 /* Last measured discharge */
+#define BQ27000_REG_AI			0x14
+#define BQ27000_REG_TTE			0x16
+#define BQ27000_REG_TTF			0x18
+#define BQ27000_REG_AE			0x22
+#define BQ27000_REG_AP			0x24
+#define BQ27000_REG_TTECP		0x26
+#define BQ27000_REG_CYCT		0x2A
+#define BQ27000_REG_ILMD		0x76 /* Initial last measured discharge */
+#define BQ27000_FLAG_EDVF		BIT(0) /* Final End-of-Discharge-Voltage flag */
+#define BQ27000_FLAG_EDV1		BIT(1) /* First End-of-Discharge-Voltage flag */
+#define BQ27000_FLAG_FC			BIT(5)
+#define BQ27000_FLAG_CHGS		BIT(7) /* Charge state flag */
+#define BQ27000_RS			20 /* Resistor sense */
+#define BQ27x00_POWER_CONSTANT		(256 * 29200 / 1000)
 
+#define BQ27500_REG_SOC			0x2C
+#define BQ27500_REG_AR		0x02
+#define BQ27500_REG_ARTTE	0x04
+#define BQ27500_REG_DCAP		0x3C /* Design capacity */
 
-#define BQ27000_FLAG_CI			BIT(4) /* Capacity Inaccurate flag */
+/* bq27425 has the bq27500 map moved down by 4 */
+#define BQ27425_REG_OFFSET		0x04
+#define BQ27425_REG(reg)		((reg) - BQ27425_REG_OFFSET)
+#define BQ27425_REG_SOC			BQ27425_REG(0x18)
 
 /*control command*/
 #define CONTROL_CMD			BQ27x00_REG_CTRL
 
 /*Control subcommand*/
+#define CONTROL_STATUS_SUBCMD           0x0000
 #define DEV_TYPE_SUBCMD                 0x0001
 #define FW_VER_SUBCMD                   0x0002
 #define DF_VER_SUBCMD                   0x000C
 #define ITENABLE_SUBCMD                 0x0021
 #define RESET_SUBCMD                    0x0041
+#define ROM_MODE_SUBCMD                 0x0F00
 
 
-#define BQ27000_RS			20 /* Resistor sense */
-#define BQ27x00_POWER_CONSTANT		(256 * 29200 / 1000)
+/*CONTROL_STATUS bits*/
+#define BQ27x00_CS_SS			BIT(13) /* sealed */
+
+/*data flash access*/
+#define BQ27x00_DF_BLOCK_SIZE		32
+#define BQ27x00_DF_RETRIES		2
+#define BQ27x00_DF_WRITE_DELAY		100 /* ms for the gauge to commit a block */
+
+/* largest single I2C transfer issued through the bulk methods */
+#define BQ27x00_BULK_MAX		128
+
+/*flash stream programming*/
+#define BQ27x00_ROM_ADDR		0x0B /* 7-bit address in ROM mode */
+#define BQ27x00_ROM_EXIT_REG		0x64
+#define BQ27x00_ROM_TIMEOUT		5000 /* ms to wait for a mode switch */
 
 struct bq27x00_device_info;
 struct bq27x00_access_methods {
 	int (*read)(struct bq27x00_device_info *di, u8 reg, bool single);
         int (*write)(struct bq27x00_device_info *di, u8 reg, u16 value,
                      bool single);
+	int (*read_bulk)(struct bq27x00_device_info *di, u8 reg, u8 *data,
+			 int len);
+	int (*write_bulk)(struct bq27x00_device_info *di, u8 reg,
+			  const u8 *data, int len);
+};
+
+/*
+ * Data flash subclass as seen through DataFlashClass()/DataFlashBlock().
+ * Volatile subclasses are updated by the gauge itself (learned
+ * resistance, lifetime data, ...), so their cached image is dropped on
+ * every open instead of being kept for the lifetime of the device.
+ */
+struct bq27x00_df_desc {
+	u8 subclass;
+	u8 blocks;
+	bool volatile_data;
+	const char *name;
+};
+
+/*
+ * State of a flash stream programming run, readable through the
+ * "flash" sysfs attribute while the run is in progress.
+ */
+struct bq27x00_flash_state {
+	struct mutex lock;	/* one programming run at a time */
+	bool active;		/* polling is suspended */
+	size_t done;		/* bytes of the image processed */
+	size_t size;
+	unsigned int line;
+	int result;		/* 1 = never run, 0 = ok, < 0 = error */
+};
+
+/* Pack identity, read once at probe and served from here afterwards */
+struct bq27x00_identity {
+	int device_type;
+	int fw_version;
+	int df_version;
+	int date;
+	int serial;
+	char manufacturer[BQ27x00_REG_CHEML - BQ27x00_REG_NAME + 1];
+	char chemistry[BQ27x00_REG_SERNUM - BQ27x00_REG_CHEM + 1];
+	char serial_str[8];
+};
+
+struct bq27x00_df_image {
+	struct bq27x00_device_info *di;
+	const struct bq27x00_df_desc *desc;
+	u8 *data;
+	unsigned long valid;	/* blocks read from the gauge */
+	unsigned long dirty;	/* blocks modified but not written back */
 };
 
 enum bq27x00_chip { BQ27000, BQ27500, BQ27425, BQ34Z100 };
 
-struct bq27x00_reg_cache {
-	int temperature;
-	int time_to_empty;
-	int time_to_empty_avg;
-	int time_to_full;
-	int charge_full;
-	int cycle_count;
-	int capacity;
-	int energy;
+/*
+ * One register as decoded by the driver: value = raw * mul / div, with
+ * raw sign extended when sign is set. Fields that land in the register
+ * cache carry their offset in it.
+ */
+struct bq27x00_field {
+	u8 reg;
+	u16 mask;	/* 0xff for single byte registers */
+	u16 sign;	/* sign bit of signed registers */
+	u16 dest;	/* offset in struct bq27x00_reg_cache */
+	int mul;
+	int div;
+};
+
+#define BQ27x00_BYTE	0x00ff
+#define BQ27x00_WORD	0xffff
+
+#define BQ27x00_FIELD(_reg, _mask, _mul, _div) \
+	{ .reg = (_reg), .mask = (_mask), .mul = (_mul), .div = (_div) }
+#define BQ27x00_SFIELD(_reg, _mul, _div) \
+	{ .reg = (_reg), .mask = BQ27x00_WORD, .sign = 0x8000, \
+	  .mul = (_mul), .div = (_div) }
+#define BQ27x00_SCACHED(_member, _reg, _mul, _div) \
+	{ .reg = (_reg), .mask = BQ27x00_WORD, .sign = 0x8000, \
+	  .dest = offsetof(struct bq27x00_reg_cache, _member), \
+	  .mul = (_mul), .div = (_div) }
+#define BQ27x00_CACHED(_member, _reg, _mask, _mul, _div) \
+	{ .reg = (_reg), .mask = (_mask), \
+	  .dest = offsetof(struct bq27x00_reg_cache, _member), \
+	  .mul = (_mul), .div = (_div) }
+
+/* moves one flag bit to where the bq34z100 has it */
+struct bq27x00_flag_map {
+	u16 from;
+	u16 to;
+};
+
+#define BQ27x00_FLAG_MAP_LEN	4
+
+/*
+ * Everything that differs between the supported chips. It is picked once
+ * at probe; the update path only walks the tables, so it does not care
+ * which chip it talks to. Flags are rewritten into the bq34z100 layout
+ * (BQ27x00_FLAG_*), so everything downstream of the cache is common.
+ */
+struct bq27x00_chip_desc {
+	/* bulk read plan: one block covering every cached field */
+	u8 snap_first;
+	u8 snap_len;
+
+	const struct bq27x00_field *fields;
+	int num_fields;
+
+	struct bq27x00_field flags;
+	u16 flags_keep;		/* bits already in the bq34z100 place */
+	u16 flags_invert;	/* applied after mapping */
+	struct bq27x00_flag_map flag_map[BQ27x00_FLAG_MAP_LEN];
+
+	/* read on demand */
+	struct bq27x00_field nac;
+	struct bq27x00_field dcap;
+	struct bq27x00_field volt;
+	struct bq27x00_field ai;
+	bool ai_charge_sign;	/* unsigned current, sign from CHGS */
+	u8 cut_len;		/* head of the snapshot block changing with
+				 * every refresh, see bq27x00_read_snap() */
+	u8 ar;			/* AtRate() in mA, 0 if there is none */
+	u8 arte;		/* AtRateTimeToEmpty() in minutes */
+
+	enum power_supply_property *props;
+	int num_props;
+
+	bool control;		/* Control() subcommands */
+	bool ident;		/* manufacturer info block at 0x6B */
+	bool dataflash;		/* bq34z100 data flash layout */
+	bool metrics;		/* extended metrics in the snapshot */
+};
+
+static const struct bq27x00_df_desc bq34z100_df_subclasses[] = {
+	{   2, 1, false, "safety" },
+	{  32, 1, false, "charge_inhibit_cfg" },
+	{  34, 1, false, "charge" },
+	{  36, 1, false, "charge_termination" },
+	{  38, 1, false, "jeita" },
+	{  48, 2, false, "data" },
+	{  49, 1, false, "discharge" },
+	{  56, 1, false, "manufacturer_data" },
+	{  58, 1, false, "manufacturer_info" },
+	{  59, 1, true,  "lifetime_data" },
+	{  60, 1, true,  "lifetime_temp_samples" },
+	{  64, 1, false, "registers" },
+	{  66, 1, false, "lifetime_resolution" },
+	{  67, 1, false, "led_display" },
+	{  68, 1, false, "power" },
+	{  80, 3, false, "it_cfg" },
+	{  81, 1, false, "current_thresholds" },
+	{  82, 1, true,  "state" },
+	{  83, 1, false, "ocv_a0" },
+	{  84, 1, false, "ocv_a1" },
+	{  85, 1, false, "def0_ra" },
+	{  86, 1, false, "def1_ra" },
+	{  87, 1, true,  "pack0_ra" },
+	{  88, 1, true,  "pack1_ra" },
+	{  89, 1, true,  "pack0_rax" },
+	{  90, 1, true,  "pack1_rax" },
+	{ 104, 1, false, "calibration_data" },
+	{ 107, 1, false, "calibration_current" },
+	{ 112, 1, false, "codes" },
+};
+
+/*
+ * Kernel thread running the bus work of one gauge, or of all of them
+ * when shared.
+ */
+struct bq27x00_worker {
+	struct kthread_worker kworker;
+	struct task_struct *task;
+	int priority;		/* SCHED_FIFO, 0 for SCHED_NORMAL */
+	int cpu;		/* < 0 for any */
+};
+
+/* what one gauge contributes to the aggregated pack */
+struct bq27x00_pack_part {
+	bool valid;
+	int charge_full;	/* uAh */
+	int capacity;		/* % */
+	int energy;		/* uWh */
+	int power;		/* uW, negative while discharging */
+	int health_rank;
 	int flags;
-	int power_avg;
-	int health;
+	int flush_budget;	/* MiB, < 0 if not configured */
+};
+
+enum bq27x00_trace_mode {
+	BQ27x00_TRACE_OFF,
+	BQ27x00_TRACE_RECORD,
+	BQ27x00_TRACE_REPLAY,
+};
+
+/*
+ * Record and replay of bus transactions. Both are done by swapping the
+ * access methods, see bq27x00_bus_rebuild(); live is the layer below
+ * the recorder.
+ */
+struct bq27x00_trace {
+	struct mutex lock;
+	enum bq27x00_trace_mode mode;
+	struct bq27x00_access_methods live;
+	u8 *buf;
+	size_t len;		/* bytes recorded or loaded */
+	size_t pos;		/* replay position */
+	ktime_t start;
+	u32 speed;		/* replay speed-up, 0 = no delays */
+	u32 dropped;		/* records that did not fit */
+	u32 mismatches;		/* replay records that did not match */
+	u32 uevents;		/* change uevents since the mode was set */
+	u32 digest;		/* crc32 of the snapshots published since */
+};
+
+#ifdef CONFIG_FAULT_INJECTION
+/* registers covered by the per-register delay and stuck tables */
+#define BQ27x00_FAULT_REGS	0x80
+#define BQ27x00_FAULT_STUCK	BIT(31)	/* stuck[] entry is active */
+
+/*
+ * Bus fault injection, a layer of access methods between the backend
+ * and the trace recorder. Probabilities, intervals and counts of the
+ * fault_attrs are set through the usual fault-injection debugfs files.
+ */
+struct bq27x00_fault {
+	bool enabled;
+	struct bq27x00_access_methods live;
+	struct fault_attr eio;		/* fail with -EIO */
+	struct fault_attr timeout;	/* fail with -ETIMEDOUT */
+	struct fault_attr stall;	/* hold the adapter for stall_ms */
+	struct fault_attr garbage;	/* return random data */
+	u32 stall_ms;
+	u32 delay_us[BQ27x00_FAULT_REGS];
+	u32 stuck[BQ27x00_FAULT_REGS];	/* BQ27x00_FAULT_STUCK | value */
+};
+#endif
+
+/* AtRate results, one per rounded rate */
+#define BQ27x00_AT_RATE_MEMO	8
+
+struct bq27x00_at_rate_memo {
+	bool valid;
+	int rate;		/* mA, rounded to at_rate_bucket */
+	int tte;		/* seconds, or -ENODATA */
+};
+
+/*
+ * AtRate queries. lock protects the memo, which holds while the state
+ * of charge and the temperature stay close to capacity and temperature,
+ * and the rates pending for work to ask the gauge about.
+ */
+struct bq27x00_at_rate {
+	struct mutex lock;
+	struct work_struct work;
+	int capacity;
+	int temperature;
+	int rate;		/* mA, last one written to sysfs */
+	int next;		/* memo entry to replace */
+	struct bq27x00_at_rate_memo memo[BQ27x00_AT_RATE_MEMO];
+	int pending[BQ27x00_AT_RATE_MEMO];	/* mA, oldest first */
+	int npending;
+};
+
+/*
+ * Token bucket bounding the bus traffic of one gauge. Tokens are kept in
+ * thousandths, so a refill is msecs * rate, and the bucket holds one
+ * second worth of traffic.
+ */
+struct bq27x00_budget {
+	spinlock_t lock;
+	unsigned int xfers;	/* transactions per second, 0 = unlimited */
+	unsigned int bytes;	/* bytes per second, 0 = unlimited */
+	long xfer_tokens;
+	long byte_tokens;
+	unsigned long stamp;	/* jiffies of the last refill */
+	unsigned long deferred;	/* reads served from cache instead */
+};
+
+enum bq27x00_last_value {
+	BQ27x00_LAST_VOLT,
+	BQ27x00_LAST_CURR,
+	BQ27x00_LAST_NAC,
+	BQ27x00_LAST_NR,
+};
+
+/*
+ * Last live reads, served when the bus budget is exhausted. Written by
+ * the update cycle and by sysfs readers, so they are only touched under
+ * lock; valid has a bit per value once it has been read.
+ */
+struct bq27x00_last {
+	spinlock_t lock;
+	int value[BQ27x00_LAST_NR];
+	unsigned long valid;
+};
+
+/* a snapshot with its freshness, copied out under update_lock */
+struct bq27x00_sample {
+	struct bq27x00_reg_cache cache;
+	ktime_t stamp;
+	u32 seq;
 };
 
 struct bq27x00_device_info {
 	struct device 		*dev;
 	int			id;
 	enum bq27x00_chip	chip;
+	const struct bq27x00_chip_desc *desc;
 
 	struct bq27x00_reg_cache cache;
 	int charge_design_full;
-
-	unsigned long last_update;
-	struct delayed_work work;
+	struct bq27x00_identity ident;
+
+	ktime_t stamp;		/* when the snapshot was last sampled */
+	u32 seq;		/* bumped on every publish */
+	int max_age;		/* ms before get_property refreshes */
+	struct bq27x00_worker *worker;
+	struct kthread_work work;
+	struct timer_list poll_timer;	/* queues work when it expires */
+
+	struct bq27x00_last last;
+	/* under update_lock */
+	u32 cut_retries;	/* snapshot blocks read again */
+	u32 cut_torn;		/* samples dropped as torn */
+	bool probed;		/* probe done, the poll work may run */
+	bool ready;		/* first sample taken */
+	bool suspended;		/* system sleep, no bus access */
 
 	struct power_supply	bat;
 
 	struct bq27x00_access_methods bus;
+	struct bq27x00_access_methods base;	/* the real backend */
+	struct bq27x00_budget budget;
 
 	struct mutex lock;
+	/* serializes update cycles, guards cache, stamp, seq and render */
+	struct mutex update_lock;
+	/* held across multi-transaction sequences, see bq27x00_seq_begin() */
+	struct mutex seq_lock;
+	/* read held by list walkers that sleep, see bq27x00_get_devices() */
+	struct rw_semaphore in_use;
+
+	struct mutex df_lock;
+	struct bq27x00_df_image df[ARRAY_SIZE(bq34z100_df_subclasses)];
+
+	struct bq27x00_flash_state flash;
+	struct bq27x00_at_rate at_rate;
+	struct bq27x00_trace trace;
+#ifdef CONFIG_FAULT_INJECTION
+	struct bq27x00_fault fault;
+#endif
+
+	struct dentry *debugfs;
+	struct iio_dev *iio;
+	struct bq27x00_render __rcu *render;	/* text outputs, see below */
+
+	struct list_head node;
+	struct bq27x00_pack_part pack_part;
+};
+
+static enum power_supply_property bq34z100_battery_props[] = {
+	POWER_SUPPLY_PROP_STATUS,
+	POWER_SUPPLY_PROP_PRESENT,
+	POWER_SUPPLY_PROP_VOLTAGE_NOW,
+	POWER_SUPPLY_PROP_CURRENT_NOW,
+	POWER_SUPPLY_PROP_CAPACITY,
+	POWER_SUPPLY_PROP_CAPACITY_LEVEL,
+	POWER_SUPPLY_PROP_TEMP,
+	POWER_SUPPLY_PROP_TIME_TO_EMPTY_NOW,
+	POWER_SUPPLY_PROP_TIME_TO_EMPTY_AVG,
+	POWER_SUPPLY_PROP_TIME_TO_FULL_NOW,
+	POWER_SUPPLY_PROP_TECHNOLOGY,
+	POWER_SUPPLY_PROP_CHARGE_FULL,
+	POWER_SUPPLY_PROP_CHARGE_NOW,
+	POWER_SUPPLY_PROP_CHARGE_FULL_DESIGN,
+	POWER_SUPPLY_PROP_CHARGE_COUNTER,
+	POWER_SUPPLY_PROP_CYCLE_COUNT,
+	POWER_SUPPLY_PROP_ENERGY_NOW,
+	POWER_SUPPLY_PROP_POWER_AVG,
+	POWER_SUPPLY_PROP_HEALTH,
+	POWER_SUPPLY_PROP_CONSTANT_CHARGE_CURRENT,
+	POWER_SUPPLY_PROP_CONSTANT_CHARGE_VOLTAGE,
+	POWER_SUPPLY_PROP_MANUFACTURER,
+	POWER_SUPPLY_PROP_SERIAL_NUMBER,
 };
 
 static enum power_supply_property bq27x00_battery_props[] = {
@@ -171,670 +605,4448 @@ static enum power_supply_property bq27x00_battery_props[] = {
 	POWER_SUPPLY_PROP_CHARGE_FULL,
 	POWER_SUPPLY_PROP_CHARGE_NOW,
 	POWER_SUPPLY_PROP_CHARGE_FULL_DESIGN,
-#if 0
 	POWER_SUPPLY_PROP_CYCLE_COUNT,
-#endif
 	POWER_SUPPLY_PROP_ENERGY_NOW,
 	POWER_SUPPLY_PROP_POWER_AVG,
 	POWER_SUPPLY_PROP_HEALTH,
 };
 
+static enum power_supply_property bq27425_battery_props[] = {
+	POWER_SUPPLY_PROP_STATUS,
+	POWER_SUPPLY_PROP_PRESENT,
+	POWER_SUPPLY_PROP_VOLTAGE_NOW,
+	POWER_SUPPLY_PROP_CURRENT_NOW,
+	POWER_SUPPLY_PROP_CAPACITY,
+	POWER_SUPPLY_PROP_CAPACITY_LEVEL,
+	POWER_SUPPLY_PROP_TEMP,
+	POWER_SUPPLY_PROP_TECHNOLOGY,
+	POWER_SUPPLY_PROP_CHARGE_FULL,
+	POWER_SUPPLY_PROP_CHARGE_NOW,
+	POWER_SUPPLY_PROP_CHARGE_FULL_DESIGN,
+};
+
+/*
+ * Per chip register descriptors
+ */
+
+static const struct bq27x00_field bq27000_fields[] = {
+	BQ27x00_CACHED(capacity, BQ27000_REG_RSOC, BQ27x00_BYTE, 1, 1),
+	/* Unit: uWh */
+	BQ27x00_CACHED(energy, BQ27000_REG_AE, BQ27x00_WORD, 29200,
+		       BQ27000_RS),
+	/* Unit: second. 65535 minutes means "not discharging" and is
+	 * passed on as is. */
+	BQ27x00_CACHED(time_to_empty, BQ27000_REG_TTE, BQ27x00_WORD, 60, 1),
+	BQ27x00_CACHED(time_to_empty_avg, BQ27000_REG_TTECP, BQ27x00_WORD,
+		       60, 1),
+	BQ27x00_CACHED(time_to_full, BQ27000_REG_TTF, BQ27x00_WORD, 60, 1),
+	/* Unit: uAh */
+	BQ27x00_CACHED(charge_full, BQ27000_REG_LMD, BQ27x00_WORD, 3570,
+		       BQ27000_RS),
+	/* Unit: 0.1K, the bq27000 counts in 0.25K */
+	BQ27x00_CACHED(temperature, BQ27000_REG_TEMP, BQ27x00_WORD, 5, 2),
+	BQ27x00_CACHED(cycle_count, BQ27000_REG_CYCT, BQ27x00_WORD, 1, 1),
+	/* Unit: uW, a magnitude the update makes negative on discharge */
+	BQ27x00_CACHED(power_avg, BQ27000_REG_AP, BQ27x00_WORD,
+		       BQ27x00_POWER_CONSTANT, BQ27000_RS),
+};
+
+static const struct bq27x00_field bq27500_fields[] = {
+	BQ27x00_CACHED(capacity, BQ27500_REG_SOC, BQ27x00_WORD, 1, 1),
+	BQ27x00_CACHED(energy, BQ27000_REG_AE, BQ27x00_WORD, 1000, 1),
+	BQ27x00_CACHED(time_to_empty, BQ27000_REG_TTE, BQ27x00_WORD, 60, 1),
+	BQ27x00_CACHED(time_to_empty_avg, BQ27000_REG_TTECP, BQ27x00_WORD,
+		       60, 1),
+	BQ27x00_CACHED(time_to_full, BQ27000_REG_TTF, BQ27x00_WORD, 60, 1),
+	BQ27x00_CACHED(charge_full, BQ27000_REG_LMD, BQ27x00_WORD, 1000, 1),
+	BQ27x00_CACHED(temperature, BQ27000_REG_TEMP, BQ27x00_WORD, 1, 1),
+	BQ27x00_CACHED(cycle_count, BQ27000_REG_CYCT, BQ27x00_WORD, 1, 1),
+	/* AveragePower() is a signed word in mW */
+	BQ27x00_SCACHED(power_avg, BQ27000_REG_AP, 1000, 1),
+};
+
+static const struct bq27x00_field bq27425_fields[] = {
+	BQ27x00_CACHED(capacity, BQ27425_REG_SOC, BQ27x00_WORD, 1, 1),
+	BQ27x00_CACHED(charge_full, BQ27425_REG(BQ27000_REG_LMD),
+		       BQ27x00_WORD, 1000, 1),
+	BQ27x00_CACHED(temperature, BQ27425_REG(BQ27000_REG_TEMP),
+		       BQ27x00_WORD, 1, 1),
+};
+
+static const struct bq27x00_field bq34z100_fields[] = {
+	/* StateOfCharge() is one byte, 0x03 holds MaxError() */
+	BQ27x00_CACHED(capacity, BQ27x00_REG_SOC, BQ27x00_BYTE, 1, 1),
+	BQ27x00_CACHED(energy, BQ27x00_REG_AE, BQ27x00_WORD, 1000, 1),
+	BQ27x00_CACHED(time_to_empty, BQ27x00_REG_TTE, BQ27x00_WORD, 60, 1),
+	BQ27x00_CACHED(time_to_empty_avg, BQ27x00_REG_TTECP, BQ27x00_WORD,
+		       60, 1),
+	BQ27x00_CACHED(time_to_full, BQ27x00_REG_TTF, BQ27x00_WORD, 60, 1),
+	BQ27x00_CACHED(charge_full, BQ27x00_REG_FCC, BQ27x00_WORD, 1000, 1),
+	BQ27x00_CACHED(temperature, BQ27x00_REG_TEMP, BQ27x00_WORD, 1, 1),
+	BQ27x00_CACHED(cycle_count, BQ27x00_REG_CYCT, BQ27x00_WORD, 1, 1),
+	/* AveragePower() is a signed word in mW */
+	BQ27x00_SCACHED(power_avg, BQ27x00_REG_AP, 1000, 1),
+	/* StateOfHealth() % is the low byte, the high one is a status */
+	BQ27x00_CACHED(state_of_health, BQ27x00_REG_SOH, BQ27x00_BYTE, 1, 1),
+	BQ27x00_CACHED(internal_temp, BQ27x00_REG_INTTEMP, BQ27x00_WORD, 1, 1),
+	BQ27x00_CACHED(charge_voltage, BQ27x00_REG_CHGV, BQ27x00_WORD,
+		       1000, 1),
+	BQ27x00_CACHED(charge_current, BQ27x00_REG_CHGI, BQ27x00_WORD,
+		       1000, 1),
+	BQ27x00_SCACHED(max_load_current, BQ27x00_REG_MLI, 1000, 1),
+	BQ27x00_CACHED(max_load_tte, BQ27x00_REG_MLTTE, BQ27x00_WORD, 60, 1),
+	BQ27x00_SCACHED(standby_current, BQ27x00_REG_SI, 1000, 1),
+	BQ27x00_CACHED(standby_tte, BQ27x00_REG_STTE, BQ27x00_WORD, 60, 1),
+	BQ27x00_SCACHED(passed_charge, BQ27x00_REG_PCHG, 1000, 1),
+	BQ27x00_CACHED(remaining_capacity, BQ27x00_REG_RM, BQ27x00_WORD,
+		       1000, 1),
+};
+
+/* bq27500 flag bits that match the bq34z100 ones */
+#define BQ27500_FLAGS_KEEP	(BQ27x00_FLAG_DSG | BQ27x00_FLAG_SOCF | \
+				 BQ27x00_FLAG_SOC1 | BQ27x00_FLAG_CHG | \
+				 BQ27x00_FLAG_FC | BQ27x00_FLAG_CHG_INH | \
+				 BQ27x00_FLAG_BATLOW | BQ27x00_FLAG_BATHIGH | \
+				 BQ27x00_FLAG_OTD | BQ27x00_FLAG_OTC)
+
+static const struct bq27x00_chip_desc bq27x00_chips[] = {
+	[BQ27000] = {
+		.snap_first = BQ27000_REG_TEMP,
+		.snap_len = BQ27000_REG_CYCT + 2 - BQ27000_REG_TEMP,
+		.cut_len = 4,
+		.fields = bq27000_fields,
+		.num_fields = ARRAY_SIZE(bq27000_fields),
+		.flags = BQ27x00_FIELD(BQ27000_REG_FLAGS, BQ27x00_BYTE, 1, 1),
+		.flags_keep = BQ27x00_FLAG_CI,
+		/* no DSG flag, discharging is "not charging" */
+		.flags_invert = BQ27x00_FLAG_DSG,
+		.flag_map = {
+			{ BQ27000_FLAG_EDVF, BQ27x00_FLAG_SOCF },
+			{ BQ27000_FLAG_EDV1, BQ27x00_FLAG_SOC1 },
+			{ BQ27000_FLAG_FC, BQ27x00_FLAG_FC },
+			{ BQ27000_FLAG_CHGS, BQ27x00_FLAG_DSG },
+		},
+		.nac = BQ27x00_FIELD(BQ27000_REG_NAC, BQ27x00_WORD, 3570,
+				     BQ27000_RS),
+		.dcap = BQ27x00_FIELD(BQ27000_REG_ILMD, BQ27x00_BYTE,
+				      256 * 3570, BQ27000_RS),
+		.volt = BQ27x00_FIELD(BQ27000_REG_VOLT, BQ27x00_WORD, 1000, 1),
+		.ai = BQ27x00_FIELD(BQ27000_REG_AI, BQ27x00_WORD, 3570,
+				    BQ27000_RS),
+		.ai_charge_sign = true,
+		.props = bq27x00_battery_props,
+		.num_props = ARRAY_SIZE(bq27x00_battery_props),
+	},
+	[BQ27500] = {
+		.snap_first = BQ27000_REG_TEMP,
+		.snap_len = BQ27500_REG_SOC + 2 - BQ27000_REG_TEMP,
+		.cut_len = 4,
+		.fields = bq27500_fields,
+		.num_fields = ARRAY_SIZE(bq27500_fields),
+		.flags = BQ27x00_FIELD(BQ27000_REG_FLAGS, BQ27x00_WORD, 1, 1),
+		.flags_keep = BQ27500_FLAGS_KEEP,
+		.nac = BQ27x00_FIELD(BQ27000_REG_NAC, BQ27x00_WORD, 1000, 1),
+		.dcap = BQ27x00_FIELD(BQ27500_REG_DCAP, BQ27x00_WORD, 1000, 1),
+		.volt = BQ27x00_FIELD(BQ27000_REG_VOLT, BQ27x00_WORD, 1000, 1),
+		.ai = BQ27x00_SFIELD(BQ27000_REG_AI, 1000, 1),
+		.ar = BQ27500_REG_AR,
+		.arte = BQ27500_REG_ARTTE,
+		.props = bq27x00_battery_props,
+		.num_props = ARRAY_SIZE(bq27x00_battery_props),
+		.control = true,
+	},
+	[BQ27425] = {
+		.snap_first = BQ27425_REG(BQ27000_REG_TEMP),
+		.snap_len = BQ27425_REG_SOC + 2 - BQ27425_REG(BQ27000_REG_TEMP),
+		.cut_len = 4,
+		.fields = bq27425_fields,
+		.num_fields = ARRAY_SIZE(bq27425_fields),
+		.flags = BQ27x00_FIELD(BQ27425_REG(BQ27000_REG_FLAGS),
+				       BQ27x00_WORD, 1, 1),
+		/* bit 14 is under-temperature here, not OTD */
+		.flags_keep = BQ27x00_FLAG_DSG | BQ27x00_FLAG_SOCF |
+			      BQ27x00_FLAG_SOC1 | BQ27x00_FLAG_CHG |
+			      BQ27x00_FLAG_FC | BQ27x00_FLAG_OTC,
+		.nac = BQ27x00_FIELD(BQ27425_REG(BQ27000_REG_NAC), BQ27x00_WORD,
+				     1000, 1),
+		.dcap = BQ27x00_FIELD(BQ27425_REG(BQ27500_REG_DCAP),
+				      BQ27x00_WORD, 1000, 1),
+		.volt = BQ27x00_FIELD(BQ27425_REG(BQ27000_REG_VOLT),
+				      BQ27x00_WORD, 1000, 1),
+		.ai = BQ27x00_SFIELD(BQ27425_REG(BQ27000_REG_AI), 1000, 1),
+		.props = bq27425_battery_props,
+		.num_props = ARRAY_SIZE(bq27425_battery_props),
+		.control = true,
+	},
+	[BQ34Z100] = {
+		.snap_first = BQ27x00_REG_SOC,
+		.snap_len = BQ27x00_REG_PCHG + 2 - BQ27x00_REG_SOC,
+		.cut_len = BQ27x00_REG_TEMP + 2 - BQ27x00_REG_SOC,
+		.fields = bq34z100_fields,
+		.num_fields = ARRAY_SIZE(bq34z100_fields),
+		.flags = BQ27x00_FIELD(BQ27x00_REG_FLAGS, BQ27x00_WORD, 1, 1),
+		.flags_keep = (u16)~BQ27x00_FLAG_CI,
+		.nac = BQ27x00_FIELD(BQ27x00_REG_NAC, BQ27x00_WORD, 1000, 1),
+		.dcap = BQ27x00_FIELD(BQ27x00_REG_DCAP, BQ27x00_WORD, 1000, 1),
+		.volt = BQ27x00_FIELD(BQ27x00_REG_VOLT, BQ27x00_WORD, 1000, 1),
+		.ai = BQ27x00_SFIELD(BQ27x00_REG_AI, 1000, 1),
+		.ar = BQ27x00_REG_AR,
+		.arte = BQ27x00_REG_ARTTE,
+		.props = bq34z100_battery_props,
+		.num_props = ARRAY_SIZE(bq34z100_battery_props),
+		.control = true,
+		.ident = true,
+		.dataflash = true,
+		.metrics = true,
+	},
+};
+
+
+static unsigned int autosuspend_delay = 2000;
+module_param(autosuspend_delay, uint, 0444);
+MODULE_PARM_DESC(autosuspend_delay, "runtime PM autosuspend delay of the " \
+				"bus path in milliseconds");
 
 static unsigned int poll_interval = 60;
 module_param(poll_interval, uint, 0644);
 MODULE_PARM_DESC(poll_interval, "battery poll interval in seconds - " \
 				"0 disables polling");
 
+static int max_age = 5000;
+module_param(max_age, int, 0644);
+MODULE_PARM_DESC(max_age, "default age in ms of the snapshot served by " \
+				"power supply reads before a bus refresh - " \
+				"-1 never refreshes");
+
+static unsigned int flush_power;
+module_param(flush_power, uint, 0644);
+MODULE_PARM_DESC(flush_power, "power drawn while flushing the write-back " \
+				"cache in mW - 0 disables the flush budget");
+
+static unsigned int flush_rate;
+module_param(flush_rate, uint, 0644);
+MODULE_PARM_DESC(flush_rate, "write-back cache flush rate in MiB/s - " \
+				"0 disables the flush budget");
+
+static unsigned int trace_size = 256;
+module_param(trace_size, uint, 0444);
+MODULE_PARM_DESC(trace_size, "size of the per gauge bus trace buffer " \
+				"in KiB");
+
+static unsigned int consistent_cut = 2;
+module_param(consistent_cut, uint, 0644);
+MODULE_PARM_DESC(consistent_cut, "times the snapshot block is read again " \
+				"when the gauge refreshed during the read - " \
+				"0 takes the block as read");
+
+static unsigned int at_rate_bucket = 50;
+module_param(at_rate_bucket, uint, 0644);
+MODULE_PARM_DESC(at_rate_bucket, "AtRate queries are rounded to multiples " \
+				"of this many mA and memoized per multiple");
+
+static unsigned int at_rate_soc_delta = 1;
+module_param(at_rate_soc_delta, uint, 0644);
+MODULE_PARM_DESC(at_rate_soc_delta, "state of charge change in percent " \
+				"that drops memoized AtRate results - " \
+				"0 drops them on any change");
+
+static unsigned int at_rate_temp_delta = 20;
+module_param(at_rate_temp_delta, uint, 0644);
+MODULE_PARM_DESC(at_rate_temp_delta, "temperature change in 0.1 K that " \
+				"drops memoized AtRate results - " \
+				"0 drops them on any change");
+
+static bool pack;
+module_param(pack, bool, 0444);
+MODULE_PARM_DESC(pack, "register a \"bq27x00-pack\" power supply " \
+				"aggregating all gauges");
+
+static int poll_priority = 1;
+module_param(poll_priority, int, 0444);
+MODULE_PARM_DESC(poll_priority, "SCHED_FIFO priority of the poll threads " \
+				"- 0 runs them as normal tasks");
+
+static int poll_cpu = -1;
+module_param(poll_cpu, int, 0444);
+MODULE_PARM_DESC(poll_cpu, "CPU the poll threads are bound to - " \
+				"-1 for any");
+
+static bool poll_shared = true;
+module_param(poll_shared, bool, 0444);
+MODULE_PARM_DESC(poll_shared, "one poll thread for all gauges instead of " \
+				"one per gauge");
+
+static BLOCKING_NOTIFIER_HEAD(bq27x00_notifier_list);
+
+static struct dentry *bq27x00_debugfs_root;
+
+/* all bound gauges, for the proc interface */
+static LIST_HEAD(bq27x00_devices);
+static DEFINE_MUTEX(bq27x00_list_lock);
+
 /*
  * Common code for BQ27x00 devices
  */
 
-static inline int bq27x00_read(struct bq27x00_device_info *di, u8 reg,
-		bool single)
+/*
+ * Every bus access holds a runtime PM reference, so the adapter path
+ * can autosuspend once the gauge has been idle for autosuspend_delay.
+ */
+static inline void bq27x00_bus_get(struct bq27x00_device_info *di)
 {
-	return di->bus.read(di, reg, single);
+	pm_runtime_get_sync(di->dev);
 }
 
-static inline int bq27x00_write(struct bq27x00_device_info *di, u8 reg,
-                u16 value, bool single)
+static inline void bq27x00_bus_put(struct bq27x00_device_info *di)
 {
-        return di->bus.write(di, reg, value, single);
+	pm_runtime_mark_last_busy(di->dev);
+	pm_runtime_put_autosuspend(di->dev);
 }
 
-
 /*
- * Return the battery State-of-Charge for bq34z100
- * Or < 0 if something fails.
+ * Poll threads
+ *
+ * The bus work runs on a kthread_worker of its own, so it does not
+ * queue behind unrelated work on the system workqueue while the
+ * machine is busy, which is just when the battery matters. There is
+ * no delayed kthread work, a timer queues it instead.
  */
-static int bq27x00_battery_read_soc(struct bq27x00_device_info *di)
+
+static struct bq27x00_worker *bq27x00_shared_worker;
+
+static int bq27x00_worker_tune(struct bq27x00_worker *w, int priority,
+		int cpu)
 {
-	int soc;
+	struct sched_param param = { .sched_priority = priority };
+	const struct cpumask *mask = cpu_possible_mask;
+	int ret;
+
+	/* sched_setscheduler() checks the upper bound of the priority */
+	if (priority < 0 || cpu >= (int)nr_cpu_ids)
+		return -EINVAL;
+
+	if (cpu >= 0) {
+		if (!cpu_online(cpu))
+			return -EINVAL;
+		mask = cpumask_of(cpu);
+	}
+
+	ret = set_cpus_allowed_ptr(w->task, mask);
+	if (ret)
+		return ret;
 
-	soc = bq27x00_read(di, BQ27x00_REG_SOC, false);
+	ret = sched_setscheduler(w->task, priority ? SCHED_FIFO : SCHED_NORMAL,
+				 &param);
+	if (ret)
+		return ret;
 
-	if (soc < 0)
-		dev_dbg(di->dev, "error reading State-of-Charge\n");
+	w->priority = priority;
+	w->cpu = cpu;
 
-	return soc;
+	return 0;
 }
 
-/*
- * Return a battery charge value in uAh
- * Or < 0 if something fails.
- */
-static int bq27x00_battery_read_charge(struct bq27x00_device_info *di, u8 reg)
+static struct bq27x00_worker *bq27x00_worker_create(const char *name)
 {
-	int charge;
+	struct bq27x00_worker *w;
+	int ret;
+
+	w = kzalloc(sizeof(*w), GFP_KERNEL);
+	if (!w)
+		return ERR_PTR(-ENOMEM);
 
-	charge = bq27x00_read(di, reg, false);
-	if (charge < 0) {
-		dev_dbg(di->dev, "error reading charge register %02x: %d\n",
-			reg, charge);
-		return charge;
+	init_kthread_worker(&w->kworker);
+	w->task = kthread_run(kthread_worker_fn, &w->kworker, "%s", name);
+	if (IS_ERR(w->task)) {
+		ret = PTR_ERR(w->task);
+		kfree(w);
+		return ERR_PTR(ret);
 	}
 
-	charge *= 1000;
+	ret = bq27x00_worker_tune(w, poll_priority, poll_cpu);
+	if (ret)
+		pr_warn("bq34z100: %s: poll_priority %d, poll_cpu %d not " \
+			"applied: %d\n", name, poll_priority, poll_cpu, ret);
 
-	return charge;
+	return w;
 }
 
-/*
- * Return the battery Nominal available capaciy in uAh
- * Or < 0 if something fails.
- */
-static inline int bq27x00_battery_read_nac(struct bq27x00_device_info *di)
+static void bq27x00_worker_destroy(struct bq27x00_worker *w)
 {
+	flush_kthread_worker(&w->kworker);
+	kthread_stop(w->task);
+	kfree(w);
+}
+
+static void bq27x00_poll_timer(unsigned long data)
+{
+	struct bq27x00_device_info *di = (struct bq27x00_device_info *)data;
+
+	queue_kthread_work(&di->worker->kworker, &di->work);
+}
 
-	return bq27x00_battery_read_charge(di, BQ27x00_REG_NAC);
+/* Queue the poll work after delay jiffies. */
+static void bq27x00_schedule_poll(struct bq27x00_device_info *di,
+		unsigned long delay)
+{
+	if (delay)
+		mod_timer(&di->poll_timer, jiffies + delay);
+	else
+		queue_kthread_work(&di->worker->kworker, &di->work);
 }
 
 /*
- * Return the battery Last measured discharge in uAh
- * Or < 0 if something fails.
+ * Wait until the poll work is neither pending nor running. The work
+ * may rearm the timer while it is flushed, hence the loop.
  */
-static inline int bq27x00_battery_read_fcc(struct bq27x00_device_info *di)
+static void bq27x00_cancel_poll(struct bq27x00_device_info *di)
 {
-	return bq27x00_battery_read_charge(di, BQ27x00_REG_FCC);
+	do {
+		del_timer_sync(&di->poll_timer);
+		flush_kthread_work(&di->work);
+	} while (timer_pending(&di->poll_timer));
 }
 
 /*
- * Return the battery Initial last measured discharge in uAh
- * Or < 0 if something fails.
+ * Bus budget
+ *
+ * Every transaction is charged to the gauge's token bucket, whoever
+ * issues it. Only reads done on behalf of userspace (live voltage,
+ * current and NAC, forced refreshes) ask for admission first and are
+ * served from the last value when the bucket is empty. The poll work's
+ * snapshot read carries the flags and is never refused: it is charged
+ * like the rest and so pushes the opportunistic reads further back.
  */
-static int bq27x00_battery_read_dcap(struct bq27x00_device_info *di)
+
+/* bytes on the wire for a word access: command plus data */
+#define BQ27x00_WORD_COST	3
+
+static void bq27x00_budget_refill(struct bq27x00_budget *b)
 {
-	int ilmd;
+	unsigned long now = jiffies;
+	unsigned int ms;
 
-	ilmd = bq27x00_read(di, BQ27x00_REG_DCAP, false);
+	if (now == b->stamp)
+		return;
 
-	if (ilmd < 0) {
-		dev_dbg(di->dev, "error reading initial last measured discharge\n");
-		return ilmd;
-	}
+	ms = jiffies_to_msecs(min(now - b->stamp, (unsigned long)HZ));
+	b->stamp = now;
 
-	ilmd *= 1000;
+	b->xfer_tokens = min_t(long, b->xfer_tokens + ms * b->xfers,
+			       b->xfers * 1000L);
+	b->byte_tokens = min_t(long, b->byte_tokens + ms * b->bytes,
+			       b->bytes * 1000L);
+}
 
-	return ilmd;
+static void bq27x00_bus_charge(struct bq27x00_device_info *di, int bytes)
+{
+	struct bq27x00_budget *b = &di->budget;
+	unsigned long flags;
+
+	spin_lock_irqsave(&b->lock, flags);
+	bq27x00_budget_refill(b);
+	/* the debt is bounded to one second of traffic */
+	if (b->xfers)
+		b->xfer_tokens = max_t(long, b->xfer_tokens - 1000,
+				       -(b->xfers * 1000L));
+	if (b->bytes)
+		b->byte_tokens = max_t(long, b->byte_tokens - bytes * 1000L,
+				       -(b->bytes * 1000L));
+	spin_unlock_irqrestore(&b->lock, flags);
 }
 
 /*
- * Return the battery Available energy in uWh
- * Or < 0 if something fails.
+ * Return true if a userspace driven read of bytes may go out now.
  */
-static int bq27x00_battery_read_energy(struct bq27x00_device_info *di)
+static bool bq27x00_bus_admit(struct bq27x00_device_info *di, int bytes)
 {
-	int ae;
-
-	ae = bq27x00_read(di, BQ27x00_REG_AE, false);
-	if (ae < 0) {
-		dev_dbg(di->dev, "error reading available energy\n");
-		return ae;
-	}
-		ae *= 1000;
+	struct bq27x00_budget *b = &di->budget;
+	unsigned long flags;
+	bool ok;
+
+	spin_lock_irqsave(&b->lock, flags);
+	bq27x00_budget_refill(b);
+	ok = (!b->xfers || b->xfer_tokens >= 1000) &&
+	     (!b->bytes || b->byte_tokens >= bytes * 1000L);
+	if (!ok)
+		b->deferred++;
+	spin_unlock_irqrestore(&b->lock, flags);
+
+	return ok;
+}
 
-	return ae;
+static void bq27x00_budget_set(struct bq27x00_device_info *di,
+		unsigned int xfers, unsigned int bytes)
+{
+	struct bq27x00_budget *b = &di->budget;
+	unsigned long flags;
+
+	spin_lock_irqsave(&b->lock, flags);
+	b->xfers = xfers;
+	b->bytes = bytes;
+	b->xfer_tokens = xfers * 1000L;
+	b->byte_tokens = bytes * 1000L;
+	b->stamp = jiffies;
+	spin_unlock_irqrestore(&b->lock, flags);
 }
 
-/*
- * Return the battery temperature in tenths of degree Kelvin(Unit:0.1K)
- * Or < 0 if something fails.
- */
-static int bq27x00_battery_read_temperature(struct bq27x00_device_info *di)
+static void bq27x00_last_set(struct bq27x00_device_info *di,
+		enum bq27x00_last_value i, int value)
 {
-	int temp;
+	struct bq27x00_last *l = &di->last;
+	unsigned long flags;
 
-	temp = bq27x00_read(di, BQ27x00_REG_TEMP, false);
-	if (temp < 0) {
-		dev_err(di->dev, "error reading temperature\n");
-		return temp;
-	}
+	spin_lock_irqsave(&l->lock, flags);
+	l->value[i] = value;
+	l->valid |= BIT(i);
+	spin_unlock_irqrestore(&l->lock, flags);
+}
+
+/* false if value i has never been read */
+static bool bq27x00_last_get(struct bq27x00_device_info *di,
+		enum bq27x00_last_value i, int *value)
+{
+	struct bq27x00_last *l = &di->last;
+	unsigned long flags;
+	bool valid;
 
+	spin_lock_irqsave(&l->lock, flags);
+	valid = l->valid & BIT(i);
+	if (valid)
+		*value = l->value[i];
+	spin_unlock_irqrestore(&l->lock, flags);
 
-	return temp;
+	return valid;
 }
 
-/*
- * Return the battery Cycle count total
- * Or < 0 if something fails.
- */
-static int bq27x00_battery_read_cyct(struct bq27x00_device_info *di)
+static inline int bq27x00_read(struct bq27x00_device_info *di, u8 reg,
+		bool single)
 {
-	int cyct;
+	int ret;
 
-	cyct = bq27x00_read(di, BQ27x00_REG_CYCT, false);
-	if (cyct < 0)
-		dev_err(di->dev, "error reading cycle count total\n");
+	bq27x00_bus_charge(di, single ? 2 : BQ27x00_WORD_COST);
+	bq27x00_bus_get(di);
+	ret = di->bus.read(di, reg, single);
+	bq27x00_bus_put(di);
 
-	return cyct;
+	return ret;
 }
 
-/*
- * Read a time register.Unit:second
- * Return < 0 if something fails.
- */
-static int bq27x00_battery_read_time(struct bq27x00_device_info *di, u8 reg)
+static inline int bq27x00_write(struct bq27x00_device_info *di, u8 reg,
+                u16 value, bool single)
 {
-	int tval;
+	int ret;
 
-	tval = bq27x00_read(di, reg, false);
-	if (tval < 0) {
-		dev_dbg(di->dev, "error reading time register %02x: %d\n",
-			reg, tval);
-		return tval;
-	}
-	/*when the battery is not discharging, tval should be 65535 and should
-		be not return error. */
-	//if (tval == 65535)
-	//	return -ENODATA;
+	bq27x00_bus_charge(di, single ? 2 : BQ27x00_WORD_COST);
+	bq27x00_bus_get(di);
+	ret = di->bus.write(di, reg, value, single);
+	bq27x00_bus_put(di);
 
-	return tval * 60;
+	return ret;
 }
 
-/*
- * Read a power avg register.
- * Return < 0 if something fails.
- */
-static int bq27x00_battery_read_pwr_avg(struct bq27x00_device_info *di, u8 reg)
+static inline int bq27x00_read_bulk(struct bq27x00_device_info *di, u8 reg,
+		u8 *data, int len)
 {
-	int tval;
+	int ret;
 
-	tval = bq27x00_read(di, reg, false);
-	if (tval < 0) {
-		dev_err(di->dev, "error reading power avg rgister  %02x: %d\n",
-			reg, tval);
-		return tval;
-	}
+	bq27x00_bus_charge(di, len + 1);
+	bq27x00_bus_get(di);
+	ret = di->bus.read_bulk(di, reg, data, len);
+	bq27x00_bus_put(di);
 
-	return tval;
+	return ret;
 }
 
-/*
- * Read flag register.
- * Return < 0 if something fails.
- */
-static int bq27x00_battery_read_health(struct bq27x00_device_info *di)
+static inline int bq27x00_write_bulk(struct bq27x00_device_info *di, u8 reg,
+		const u8 *data, int len)
 {
-	int tval;
+	int ret;
 
-	tval = bq27x00_read(di, BQ27x00_REG_FLAGS, false);
-	if (tval < 0) {
-		dev_err(di->dev, "error reading flag register:%d\n", tval);
-		return tval;
-	}
+	bq27x00_bus_charge(di, len + 1);
+	bq27x00_bus_get(di);
+	ret = di->bus.write_bulk(di, reg, data, len);
+	bq27x00_bus_put(di);
 
-	if (tval & BQ27x00_FLAG_SOCF)
-		tval = POWER_SUPPLY_HEALTH_DEAD;
-	else if (tval & BQ27x00_FLAG_OTC)
-		tval = POWER_SUPPLY_HEALTH_OVERHEAT;
-	else
-		tval = POWER_SUPPLY_HEALTH_GOOD;
+	return ret;
+}
 
-	return tval;
+/*
+ * Bus trace
+ *
+ * In record mode every transaction is appended to the trace buffer as a
+ * struct bq27x00_trace_rec. In replay mode a loaded trace stands in for
+ * the gauge: transactions are answered from the records in order, and
+ * the poll work is scheduled from the record timestamps divided by
+ * speed, so a recorded outage plays back at original or accelerated
+ * pace. Records that do not match the request are answered anyway and
+ * counted in mismatches. Forced refreshes are not served while
+ * replaying, only the poll work consumes records, in recorded order.
+ *
+ * Both modes count the change uevents and digest the snapshots
+ * published since the mode was set, so a replay can be compared with
+ * the run it was recorded from.
+ */
 
+static inline bool bq27x00_replaying(struct bq27x00_device_info *di)
+{
+	return di->trace.mode == BQ27x00_TRACE_REPLAY;
 }
-/* FIXME:we should take care of the flags here.*/
 
-/*we should put cache here as a gloable variable to share it with proc read function.
- * and may be should add a lock to access it serially.*/
-struct bq27x00_reg_cache cache = {0, };
-
-static void bq27x00_update(struct bq27x00_device_info *di)
+static void bq27x00_trace_uevent(struct bq27x00_device_info *di,
+		const struct bq27x00_reg_cache *cache)
 {
+	struct bq27x00_trace *t = &di->trace;
 
-	cache.flags = bq27x00_read(di, BQ27x00_REG_FLAGS, false);
-	if (cache.flags >= 0) {
-//		if (cache.flags & BQ27000_FLAG_CI) {
-		if (0) {
-			dev_info(di->dev, "battery is not calibrated! ignoring capacity values\n");
-			cache.capacity = -ENODATA;
-			cache.energy = -ENODATA;
-			cache.time_to_empty = -ENODATA;
-			cache.time_to_empty_avg = -ENODATA;
-			cache.time_to_full = -ENODATA;
-			cache.charge_full = -ENODATA;
-			cache.health = -ENODATA;
-		} else {
-			cache.capacity = bq27x00_battery_read_soc(di);
-			cache.energy = bq27x00_battery_read_energy(di);
-			cache.time_to_empty = bq27x00_battery_read_time(di,BQ27x00_REG_TTE);
-			cache.time_to_empty_avg = bq27x00_battery_read_time(di,BQ27x00_REG_TTECP);
-			cache.time_to_full = bq27x00_battery_read_time(di,BQ27x00_REG_TTF);
-			cache.charge_full = bq27x00_battery_read_fcc(di);
-			cache.health = bq27x00_battery_read_health(di);
-		}
-		cache.temperature = bq27x00_battery_read_temperature(di);
-		cache.cycle_count = bq27x00_battery_read_cyct(di);
-		cache.power_avg = bq27x00_battery_read_pwr_avg(di, BQ27x00_REG_AP);
+	mutex_lock(&t->lock);
+	t->uevents++;
+	if (cache)
+		t->digest = crc32(t->digest, cache, sizeof(*cache));
+	mutex_unlock(&t->lock);
+}
 
-		/* We only have to read charge design full once */
-		if (di->charge_design_full <= 0)
-			di->charge_design_full = bq27x00_battery_read_dcap(di);
-	}
+static bool bq27x00_trace_is_bulk(u8 op)
+{
+	return op == BQ27x00_TRACE_READ_BULK || op == BQ27x00_TRACE_WRITE_BULK;
+}
 
-	if (memcmp(&di->cache, &cache, sizeof(cache)) != 0) {
-		di->cache = cache;
-		power_supply_changed(&di->bat);
+static void bq27x00_trace_add(struct bq27x00_device_info *di, u8 op, u8 reg,
+		int result, u16 value, const u8 *data)
+{
+	struct bq27x00_trace *t = &di->trace;
+	struct bq27x00_trace_rec rec;
+	size_t len = bq27x00_trace_is_bulk(op) ? value : 0;
+
+	rec.ts = ktime_to_ns(ktime_sub(ktime_get(), t->start));
+	rec.result = result;
+	rec.value = value;
+	rec.op = op;
+	rec.reg = reg;
+
+	mutex_lock(&t->lock);
+	if (t->len + sizeof(rec) + len > trace_size * 1024) {
+		t->dropped++;
+	} else {
+		memcpy(t->buf + t->len, &rec, sizeof(rec));
+		if (data)
+			memcpy(t->buf + t->len + sizeof(rec), data, len);
+		else
+			memset(t->buf + t->len + sizeof(rec), 0, len);
+		t->len += sizeof(rec) + len;
 	}
-
-	di->last_update = jiffies;
+	mutex_unlock(&t->lock);
 }
 
-static void bq27x00_battery_poll(struct work_struct *work)
+static int bq27x00_trace_read(struct bq27x00_device_info *di, u8 reg,
+		bool single)
 {
-	struct bq27x00_device_info *di =
-		container_of(work, struct bq27x00_device_info, work.work);
+	int ret = di->trace.live.read(di, reg, single);
 
-	bq27x00_update(di);
+	bq27x00_trace_add(di, single ? BQ27x00_TRACE_READ_BYTE :
+			  BQ27x00_TRACE_READ_WORD, reg, ret, 0, NULL);
 
-	if (poll_interval > 0) {
-		/* The timer does not have to be accurate. */
-#if 0
-		set_timer_slack(&di->work.timer, poll_interval * HZ / 4);
-#endif
-		schedule_delayed_work(&di->work, poll_interval * HZ);
+	return ret;
+}
+
+static int bq27x00_trace_write(struct bq27x00_device_info *di, u8 reg,
+		u16 value, bool single)
+{
+	int ret = di->trace.live.write(di, reg, value, single);
+
+	bq27x00_trace_add(di, single ? BQ27x00_TRACE_WRITE_BYTE :
+			  BQ27x00_TRACE_WRITE_WORD, reg, ret, value, NULL);
+
+	return ret;
+}
+
+static int bq27x00_trace_read_bulk(struct bq27x00_device_info *di, u8 reg,
+		u8 *data, int len)
+{
+	int ret = di->trace.live.read_bulk(di, reg, data, len);
+
+	bq27x00_trace_add(di, BQ27x00_TRACE_READ_BULK, reg, ret, len,
+			  ret ? NULL : data);
+
+	return ret;
+}
+
+static int bq27x00_trace_write_bulk(struct bq27x00_device_info *di, u8 reg,
+		const u8 *data, int len)
+{
+	int ret = di->trace.live.write_bulk(di, reg, data, len);
+
+	bq27x00_trace_add(di, BQ27x00_TRACE_WRITE_BULK, reg, ret, len, data);
+
+	return ret;
+}
+
+/*
+ * Take the next record off the replay trace. Returns its result, or
+ * -EIO once the trace is exhausted. Bulk payload is copied to data; a
+ * record with less payload than asked for fails with -EIO and leaves
+ * data zeroed.
+ */
+static int bq27x00_replay_next(struct bq27x00_device_info *di, u8 op, u8 reg,
+		u16 value, u8 *data)
+{
+	struct bq27x00_trace *t = &di->trace;
+	struct bq27x00_trace_rec rec;
+	size_t len;
+	int ret;
+
+	mutex_lock(&t->lock);
+
+	if (t->pos + sizeof(rec) > t->len) {
+		if (t->pos != t->len + 1) {
+			dev_info(di->dev, "replay finished\n");
+			t->pos = t->len + 1;
+		}
+		ret = -EIO;
+		goto out;
+	}
+
+	memcpy(&rec, t->buf + t->pos, sizeof(rec));
+	len = bq27x00_trace_is_bulk(rec.op) ? rec.value : 0;
+	if (t->pos + sizeof(rec) + len > t->len) {
+		t->pos = t->len;
+		ret = -EIO;
+		goto out;
+	}
+
+	if (rec.op != op || rec.reg != reg ||
+	    (op != BQ27x00_TRACE_READ_BYTE && op != BQ27x00_TRACE_READ_WORD &&
+	     rec.value != value)) {
+		dev_dbg(di->dev, "replay mismatch at %zu: op %u reg 0x%02x\n",
+			t->pos, op, reg);
+		t->mismatches++;
+	}
+
+	t->pos += sizeof(rec) + len;
+	ret = rec.result;
+
+	if (op == BQ27x00_TRACE_READ_BULK) {
+		if (len >= value) {
+			memcpy(data, t->buf + t->pos - len, value);
+		} else {
+			memset(data, 0, value);
+			ret = -EIO;
+		}
 	}
+out:
+	mutex_unlock(&t->lock);
+
+	return ret;
+}
+
+static int bq27x00_replay_read(struct bq27x00_device_info *di, u8 reg,
+		bool single)
+{
+	return bq27x00_replay_next(di, single ? BQ27x00_TRACE_READ_BYTE :
+				   BQ27x00_TRACE_READ_WORD, reg, 0, NULL);
+}
+
+static int bq27x00_replay_write(struct bq27x00_device_info *di, u8 reg,
+		u16 value, bool single)
+{
+	return bq27x00_replay_next(di, single ? BQ27x00_TRACE_WRITE_BYTE :
+				   BQ27x00_TRACE_WRITE_WORD, reg, value, NULL);
+}
+
+static int bq27x00_replay_read_bulk(struct bq27x00_device_info *di, u8 reg,
+		u8 *data, int len)
+{
+	return bq27x00_replay_next(di, BQ27x00_TRACE_READ_BULK, reg, len, data);
 }
 
+static int bq27x00_replay_write_bulk(struct bq27x00_device_info *di, u8 reg,
+		const u8 *data, int len)
+{
+	return bq27x00_replay_next(di, BQ27x00_TRACE_WRITE_BULK, reg, len,
+				   NULL);
+}
+
+static const struct bq27x00_access_methods bq27x00_trace_methods = {
+	.read = bq27x00_trace_read,
+	.write = bq27x00_trace_write,
+	.read_bulk = bq27x00_trace_read_bulk,
+	.write_bulk = bq27x00_trace_write_bulk,
+};
+
+static const struct bq27x00_access_methods bq27x00_replay_methods = {
+	.read = bq27x00_replay_read,
+	.write = bq27x00_replay_write,
+	.read_bulk = bq27x00_replay_read_bulk,
+	.write_bulk = bq27x00_replay_write_bulk,
+};
+
 /*
- * Return the battery average current in uA
- * Note that current can be negative signed as well
- * Or 0 if something fails.
+ * Whether to poll again, and in how many jiffies. While replaying, that
+ * is when the next record was taken, scaled by speed, whatever
+ * poll_interval says; an exhausted trace falls back to poll_interval.
+ * A gauge that is not probed, or no longer, is never polled.
  */
-static int bq27x00_battery_current(struct bq27x00_device_info *di,
-	union power_supply_propval *val)
+static bool bq27x00_poll_delay(struct bq27x00_device_info *di,
+		unsigned long *delay)
 {
-	int curr;
+	struct bq27x00_trace *t = &di->trace;
+	struct bq27x00_trace_rec rec;
+	bool poll = poll_interval > 0 && di->probed;
+	s64 due;
+
+	*delay = poll_interval * HZ;
+
+	mutex_lock(&t->lock);
+	if (t->mode == BQ27x00_TRACE_REPLAY && t->pos + sizeof(rec) <= t->len &&
+	    di->probed) {
+		poll = true;
+		if (!t->speed) {
+			*delay = 0;
+		} else {
+			memcpy(&rec, t->buf + t->pos, sizeof(rec));
+			due = div_u64(rec.ts, t->speed) -
+			      ktime_to_ns(ktime_sub(ktime_get(), t->start));
+			*delay = due > 0 ? nsecs_to_jiffies(due) : 0;
+		}
+	}
+	mutex_unlock(&t->lock);
 
-	curr = bq27x00_read(di, BQ27x00_REG_AI, false);
-	if (curr < 0) {
-		dev_err(di->dev, "error reading current\n");
-		return curr;
+	return poll;
+}
+
+/*
+ * Fault injection
+ */
+
+#ifdef CONFIG_FAULT_INJECTION
+static int bq27x00_fault_pre(struct bq27x00_device_info *di, u8 reg)
+{
+	struct bq27x00_fault *fi = &di->fault;
+	struct i2c_adapter *adap = to_i2c_client(di->dev)->adapter;
+	u32 us = reg < BQ27x00_FAULT_REGS ? fi->delay_us[reg] : 0;
+
+	if (us >= 20000)
+		msleep(us / 1000);
+	else if (us)
+		usleep_range(us, us + us / 8 + 1);
+
+	/* like a slave stretching the clock: nobody else gets the bus */
+	if (fi->stall_ms && should_fail(&fi->stall, 1)) {
+		i2c_lock_adapter(adap);
+		msleep(fi->stall_ms);
+		i2c_unlock_adapter(adap);
 	}
 
-	val->intval = (int)((s16)curr) * 1000;
+	if (should_fail(&fi->eio, 1))
+		return -EIO;
+	if (should_fail(&fi->timeout, 1))
+		return -ETIMEDOUT;
 
 	return 0;
 }
 
-static int bq27x00_battery_status(struct bq27x00_device_info *di,
-	union power_supply_propval *val)
+/* Apply stuck registers and garbage to data read from reg on. */
+static void bq27x00_fault_data(struct bq27x00_device_info *di, u8 reg,
+		u8 *data, int len)
 {
-	int status;
+	struct bq27x00_fault *fi = &di->fault;
+	int i;
 
-	if (di->cache.flags & BQ27x00_FLAG_FC)
-		status = POWER_SUPPLY_STATUS_FULL;
-	else if (di->cache.flags & BQ27x00_FLAG_DSG)
-		status = POWER_SUPPLY_STATUS_DISCHARGING;
-	else
-		status = POWER_SUPPLY_STATUS_CHARGING;
+	if (should_fail(&fi->garbage, len)) {
+		get_random_bytes(data, len);
+		return;
+	}
 
-	val->intval = status;
+	for (i = 0; i < len && reg + i < BQ27x00_FAULT_REGS; i++)
+		if (fi->stuck[reg + i] & BQ27x00_FAULT_STUCK)
+			data[i] = fi->stuck[reg + i];
+}
 
-	return 0;
+static int bq27x00_fault_read(struct bq27x00_device_info *di, u8 reg,
+		bool single)
+{
+	u8 data[2];
+	int ret;
+
+	ret = bq27x00_fault_pre(di, reg);
+	if (ret)
+		return ret;
+
+	ret = di->fault.live.read(di, reg, single);
+	if (ret < 0)
+		return ret;
+
+	put_unaligned_le16(ret, data);
+	bq27x00_fault_data(di, reg, data, single ? 1 : 2);
+
+	return single ? data[0] : get_unaligned_le16(data);
 }
 
-static int bq27x00_battery_capacity_level(struct bq27x00_device_info *di,
-	union power_supply_propval *val)
+static int bq27x00_fault_write(struct bq27x00_device_info *di, u8 reg,
+		u16 value, bool single)
 {
-	int level;
+	int ret = bq27x00_fault_pre(di, reg);
 
-	if (di->cache.flags & BQ27x00_FLAG_FC)
-		level = POWER_SUPPLY_CAPACITY_LEVEL_FULL;
-	else if (di->cache.flags & BQ27x00_FLAG_SOC1)
-		level = POWER_SUPPLY_CAPACITY_LEVEL_LOW;
-	else if (di->cache.flags & BQ27x00_FLAG_SOCF)
-		level = POWER_SUPPLY_CAPACITY_LEVEL_CRITICAL;
-	else
-		level = POWER_SUPPLY_CAPACITY_LEVEL_NORMAL;
+	return ret ? ret : di->fault.live.write(di, reg, value, single);
+}
 
-	val->intval = level;
+static int bq27x00_fault_read_bulk(struct bq27x00_device_info *di, u8 reg,
+		u8 *data, int len)
+{
+	int ret;
 
-	return 0;
+	ret = bq27x00_fault_pre(di, reg);
+	if (ret)
+		return ret;
+
+	ret = di->fault.live.read_bulk(di, reg, data, len);
+	if (!ret)
+		bq27x00_fault_data(di, reg, data, len);
+
+	return ret;
+}
+
+static int bq27x00_fault_write_bulk(struct bq27x00_device_info *di, u8 reg,
+		const u8 *data, int len)
+{
+	int ret = bq27x00_fault_pre(di, reg);
+
+	return ret ? ret : di->fault.live.write_bulk(di, reg, data, len);
+}
+
+static const struct bq27x00_access_methods bq27x00_fault_methods = {
+	.read = bq27x00_fault_read,
+	.write = bq27x00_fault_write,
+	.read_bulk = bq27x00_fault_read_bulk,
+	.write_bulk = bq27x00_fault_write_bulk,
+};
+
+static inline bool bq27x00_fault_enabled(struct bq27x00_device_info *di)
+{
+	return di->fault.enabled;
+}
+#else
+static inline bool bq27x00_fault_enabled(struct bq27x00_device_info *di)
+{
+	return false;
 }
+#endif
 
 /*
- * Return the battery Voltage in millivolts(Unit:mV/1000)
- * Or < 0 if something fails.
+ * Put the access method layers on top of each other: the backend (the
+ * bus, or a trace being replayed), fault injection, the trace recorder.
+ * Called with di->lock held and the poll work stopped.
  */
-static int bq27x00_battery_voltage(struct bq27x00_device_info *di,
-	union power_supply_propval *val)
+static void bq27x00_bus_rebuild(struct bq27x00_device_info *di)
 {
-	int volt;
+	struct bq27x00_access_methods m = di->base;
 
-	volt = bq27x00_read(di, BQ27x00_REG_VOLT, false);
-	if (volt < 0) {
-		dev_err(di->dev, "error reading voltage\n");
-		return volt;
+	if (di->trace.mode == BQ27x00_TRACE_REPLAY)
+		m = bq27x00_replay_methods;
+
+#ifdef CONFIG_FAULT_INJECTION
+	if (bq27x00_fault_enabled(di)) {
+		di->fault.live = m;
+		m = bq27x00_fault_methods;
 	}
+#endif
+
+	if (di->trace.mode == BQ27x00_TRACE_RECORD) {
+		di->trace.live = m;
+		m = bq27x00_trace_methods;
+	}
+
+	di->bus = m;
+}
 
-	val->intval = volt * 1000;
+/*
+ * Take the gauge away from the poll work to change the bus layers, the
+ * same way flashing does.
+ */
+static int bq27x00_bus_quiesce(struct bq27x00_device_info *di)
+{
+	mutex_lock(&di->lock);
+	if (di->flash.active) {
+		mutex_unlock(&di->lock);
+		return -EBUSY;
+	}
+	bq27x00_cancel_poll(di);
 
 	return 0;
 }
 
-static int bq27x00_simple_value(int value,
-	union power_supply_propval *val)
+static void bq27x00_bus_unquiesce(struct bq27x00_device_info *di)
 {
-	if (value < 0)
-		return value;
+	mutex_unlock(&di->lock);
+	if (di->probed)
+		bq27x00_schedule_poll(di, 0);
+}
 
-	val->intval = value;
+#ifdef CONFIG_FAULT_INJECTION
+static ssize_t bq27x00_fault_enable_read(struct file *file, char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct bq27x00_device_info *di = file->private_data;
+	char tmp[4];
+	int len;
+
+	len = snprintf(tmp, sizeof(tmp), "%d\n", di->fault.enabled);
+
+	return simple_read_from_buffer(buf, count, ppos, tmp, len);
+}
+
+static ssize_t bq27x00_fault_enable_write(struct file *file,
+		const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct bq27x00_device_info *di = file->private_data;
+	char tmp[8];
+	bool enable;
+	int ret;
+
+	if (count >= sizeof(tmp))
+		return -EINVAL;
+	if (copy_from_user(tmp, buf, count))
+		return -EFAULT;
+	tmp[count] = '\0';
+
+	ret = strtobool(tmp, &enable);
+	if (ret)
+		return ret;
+
+	ret = bq27x00_bus_quiesce(di);
+	if (ret)
+		return ret;
+	di->fault.enabled = enable;
+	bq27x00_bus_rebuild(di);
+	bq27x00_bus_unquiesce(di);
+
+	return count;
+}
+
+static const struct file_operations bq27x00_fault_enable_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = bq27x00_fault_enable_read,
+	.write = bq27x00_fault_enable_write,
+	.llseek = default_llseek,
+};
+
+/*
+ * The delay_us and stuck tables read back as "reg value" lines for the
+ * registers that are set, and take one "reg value" pair per write.
+ * Writing a negative stuck value releases the register.
+ */
+static ssize_t bq27x00_fault_table_read(struct file *file, char __user *buf,
+		size_t count, loff_t *ppos, const u32 *table, u32 active)
+{
+	char *tmp;
+	ssize_t ret;
+	int i, len = 0;
+
+	tmp = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!tmp)
+		return -ENOMEM;
+
+	for (i = 0; i < BQ27x00_FAULT_REGS; i++)
+		if (table[i] & active)
+			len += scnprintf(tmp + len, PAGE_SIZE - len,
+					 "0x%02x %u\n", i, table[i] & ~active);
+
+	ret = simple_read_from_buffer(buf, count, ppos, tmp, len);
+	kfree(tmp);
+
+	return ret;
+}
+
+static int bq27x00_fault_table_parse(const char __user *buf, size_t count,
+		unsigned int *reg, int *value)
+{
+	char tmp[32];
+
+	if (count >= sizeof(tmp))
+		return -EINVAL;
+	if (copy_from_user(tmp, buf, count))
+		return -EFAULT;
+	tmp[count] = '\0';
+
+	if (sscanf(tmp, "%i %i", reg, value) != 2 ||
+	    *reg >= BQ27x00_FAULT_REGS)
+		return -EINVAL;
 
 	return 0;
 }
 
-#define to_bq27x00_device_info(x) container_of((x), \
-				struct bq27x00_device_info, bat);
+static ssize_t bq27x00_fault_delay_read(struct file *file, char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct bq27x00_device_info *di = file->private_data;
 
-static int bq27x00_battery_get_property(struct power_supply *psy,
-					enum power_supply_property psp,
-					union power_supply_propval *val)
+	return bq27x00_fault_table_read(file, buf, count, ppos,
+					di->fault.delay_us, ~0U);
+}
+
+static ssize_t bq27x00_fault_delay_write(struct file *file,
+		const char __user *buf, size_t count, loff_t *ppos)
 {
-	int ret = 0;
-	struct bq27x00_device_info *di = to_bq27x00_device_info(psy);
+	struct bq27x00_device_info *di = file->private_data;
+	unsigned int reg;
+	int value, ret;
 
-	mutex_lock(&di->lock);
-	if (time_is_before_jiffies(di->last_update + 5 * HZ)) {
-		cancel_delayed_work_sync(&di->work);
-		bq27x00_battery_poll(&di->work.work);
-	}
-	mutex_unlock(&di->lock);
+	ret = bq27x00_fault_table_parse(buf, count, &reg, &value);
+	if (ret)
+		return ret;
 
-	if (psp != POWER_SUPPLY_PROP_PRESENT && di->cache.flags < 0)
-		return -ENODEV;
+	di->fault.delay_us[reg] = max(value, 0);
 
-	switch (psp) {
-	case POWER_SUPPLY_PROP_STATUS:
-		ret = bq27x00_battery_status(di, val);
+	return count;
+}
+
+static ssize_t bq27x00_fault_stuck_read(struct file *file, char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct bq27x00_device_info *di = file->private_data;
+
+	return bq27x00_fault_table_read(file, buf, count, ppos,
+					di->fault.stuck, BQ27x00_FAULT_STUCK);
+}
+
+static ssize_t bq27x00_fault_stuck_write(struct file *file,
+		const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct bq27x00_device_info *di = file->private_data;
+	unsigned int reg;
+	int value, ret;
+
+	ret = bq27x00_fault_table_parse(buf, count, &reg, &value);
+	if (ret)
+		return ret;
+
+	di->fault.stuck[reg] = value < 0 ? 0 :
+			       BQ27x00_FAULT_STUCK | (value & 0xff);
+
+	return count;
+}
+
+static const struct file_operations bq27x00_fault_delay_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = bq27x00_fault_delay_read,
+	.write = bq27x00_fault_delay_write,
+	.llseek = default_llseek,
+};
+
+static const struct file_operations bq27x00_fault_stuck_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = bq27x00_fault_stuck_read,
+	.write = bq27x00_fault_stuck_write,
+	.llseek = default_llseek,
+};
+
+static void bq27x00_fault_init(struct bq27x00_device_info *di)
+{
+	static const struct fault_attr init = FAULT_ATTR_INITIALIZER;
+	struct bq27x00_fault *fi = &di->fault;
+	struct dentry *dir;
+
+	fi->eio = init;
+	fi->timeout = init;
+	fi->stall = init;
+	fi->garbage = init;
+
+	if (!di->debugfs)
+		return;
+
+	dir = debugfs_create_dir("fault", di->debugfs);
+	if (IS_ERR_OR_NULL(dir))
+		return;
+
+	debugfs_create_file("enable", S_IRUSR | S_IWUSR, dir, di,
+			    &bq27x00_fault_enable_fops);
+	debugfs_create_file("delay_us", S_IRUSR | S_IWUSR, dir, di,
+			    &bq27x00_fault_delay_fops);
+	debugfs_create_file("stuck", S_IRUSR | S_IWUSR, dir, di,
+			    &bq27x00_fault_stuck_fops);
+	debugfs_create_u32("stall_ms", S_IRUSR | S_IWUSR, dir, &fi->stall_ms);
+	fault_create_debugfs_attr("fail_eio", dir, &fi->eio);
+	fault_create_debugfs_attr("fail_timeout", dir, &fi->timeout);
+	fault_create_debugfs_attr("stall", dir, &fi->stall);
+	fault_create_debugfs_attr("garbage", dir, &fi->garbage);
+}
+#else
+static inline void bq27x00_fault_init(struct bq27x00_device_info *di)
+{
+}
+#endif
+
+static const char * const bq27x00_trace_modes[] = {
+	[BQ27x00_TRACE_OFF] = "off",
+	[BQ27x00_TRACE_RECORD] = "record",
+	[BQ27x00_TRACE_REPLAY] = "replay",
+};
+
+/*
+ * Switch the access methods with the poll work stopped, the same way
+ * flashing takes the gauge away from it.
+ */
+static int bq27x00_trace_set_mode(struct bq27x00_device_info *di,
+		enum bq27x00_trace_mode mode)
+{
+	struct bq27x00_trace *t = &di->trace;
+	int ret;
+
+	ret = bq27x00_bus_quiesce(di);
+	if (ret)
+		return ret;
+
+	mutex_lock(&t->lock);
+	t->start = ktime_get();
+	switch (mode) {
+	case BQ27x00_TRACE_RECORD:
+		t->len = 0;
+		t->dropped = 0;
 		break;
-	case POWER_SUPPLY_PROP_VOLTAGE_NOW:
-		ret = bq27x00_battery_voltage(di, val);
-		break;
-	case POWER_SUPPLY_PROP_PRESENT:
-		val->intval = di->cache.flags < 0 ? 0 : 1;
-		break;
-	case POWER_SUPPLY_PROP_CURRENT_NOW:
-		ret = bq27x00_battery_current(di, val);
-		break;
-	case POWER_SUPPLY_PROP_CAPACITY:
-		ret = bq27x00_simple_value(di->cache.capacity, val);
-		break;
-	case POWER_SUPPLY_PROP_CAPACITY_LEVEL:
-		ret = bq27x00_battery_capacity_level(di, val);
-		break;
-	case POWER_SUPPLY_PROP_TEMP:
-		ret = bq27x00_simple_value(di->cache.temperature, val);
-		/* change the unit into tenths of degree Celsius(0.1C)*/
-		if (ret == 0)
-			val->intval -= 2731;
-		break;
-	case POWER_SUPPLY_PROP_TIME_TO_EMPTY_NOW:
-		ret = bq27x00_simple_value(di->cache.time_to_empty, val);
-		break;
-	case POWER_SUPPLY_PROP_TIME_TO_EMPTY_AVG:
-		ret = bq27x00_simple_value(di->cache.time_to_empty_avg, val);
-		break;
-	case POWER_SUPPLY_PROP_TIME_TO_FULL_NOW:
-		ret = bq27x00_simple_value(di->cache.time_to_full, val);
-		break;
-	case POWER_SUPPLY_PROP_TECHNOLOGY:
-		val->intval = POWER_SUPPLY_TECHNOLOGY_LION;
-		break;
-	case POWER_SUPPLY_PROP_CHARGE_NOW:
-		ret = bq27x00_simple_value(bq27x00_battery_read_nac(di), val);
-		break;
-	case POWER_SUPPLY_PROP_CHARGE_FULL:
-		ret = bq27x00_simple_value(di->cache.charge_full, val);
-		break;
-	case POWER_SUPPLY_PROP_CHARGE_FULL_DESIGN:
-		ret = bq27x00_simple_value(di->charge_design_full, val);
-		break;
-#if 0
-	case POWER_SUPPLY_PROP_CYCLE_COUNT:
-		ret = bq27x00_simple_value(di->cache.cycle_count, val);
-		break;
-#endif
-	case POWER_SUPPLY_PROP_ENERGY_NOW:
-		ret = bq27x00_simple_value(di->cache.energy, val);
-		break;
-	case POWER_SUPPLY_PROP_POWER_AVG:
-		ret = bq27x00_simple_value(di->cache.power_avg, val);
-		break;
-	case POWER_SUPPLY_PROP_HEALTH:
-		ret = bq27x00_simple_value(di->cache.health, val);
+	case BQ27x00_TRACE_REPLAY:
+		t->pos = 0;
+		t->mismatches = 0;
 		break;
 	default:
+		break;
+	}
+	t->uevents = 0;
+	t->digest = 0;
+	t->mode = mode;
+	mutex_unlock(&t->lock);
+
+	bq27x00_bus_rebuild(di);
+	bq27x00_bus_unquiesce(di);
+
+	return 0;
+}
+
+static ssize_t bq27x00_trace_mode_read(struct file *file, char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct bq27x00_device_info *di = file->private_data;
+	char tmp[16];
+	int len;
+
+	len = snprintf(tmp, sizeof(tmp), "%s\n",
+		       bq27x00_trace_modes[di->trace.mode]);
+
+	return simple_read_from_buffer(buf, count, ppos, tmp, len);
+}
+
+static ssize_t bq27x00_trace_mode_write(struct file *file,
+		const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct bq27x00_device_info *di = file->private_data;
+	char tmp[16];
+	int i, ret;
+
+	if (count >= sizeof(tmp))
 		return -EINVAL;
+	if (copy_from_user(tmp, buf, count))
+		return -EFAULT;
+	tmp[count] = '\0';
+
+	for (i = 0; i < ARRAY_SIZE(bq27x00_trace_modes); i++)
+		if (sysfs_streq(tmp, bq27x00_trace_modes[i]))
+			break;
+	if (i == ARRAY_SIZE(bq27x00_trace_modes))
+		return -EINVAL;
+
+	ret = bq27x00_trace_set_mode(di, i);
+
+	return ret ? ret : count;
+}
+
+static const struct file_operations bq27x00_trace_mode_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = bq27x00_trace_mode_read,
+	.write = bq27x00_trace_mode_write,
+	.llseek = default_llseek,
+};
+
+/* Opening the data for writing starts loading a new trace for replay. */
+static int bq27x00_trace_data_open(struct inode *inode, struct file *file)
+{
+	struct bq27x00_device_info *di = inode->i_private;
+	struct bq27x00_trace *t = &di->trace;
+	int ret = 0;
+
+	file->private_data = di;
+
+	if (!(file->f_mode & FMODE_WRITE))
+		return 0;
+
+	mutex_lock(&t->lock);
+	if (t->mode != BQ27x00_TRACE_OFF)
+		ret = -EBUSY;
+	else
+		t->len = 0;
+	mutex_unlock(&t->lock);
+
+	return ret;
+}
+
+static ssize_t bq27x00_trace_data_read(struct file *file, char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct bq27x00_trace *t =
+		&((struct bq27x00_device_info *)file->private_data)->trace;
+	ssize_t ret;
+
+	mutex_lock(&t->lock);
+	ret = simple_read_from_buffer(buf, count, ppos, t->buf, t->len);
+	mutex_unlock(&t->lock);
+
+	return ret;
+}
+
+static ssize_t bq27x00_trace_data_write(struct file *file,
+		const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct bq27x00_trace *t =
+		&((struct bq27x00_device_info *)file->private_data)->trace;
+	ssize_t ret;
+
+	mutex_lock(&t->lock);
+	if (t->mode != BQ27x00_TRACE_OFF) {
+		ret = -EBUSY;
+	} else {
+		ret = simple_write_to_buffer(t->buf, trace_size * 1024, ppos,
+					     buf, count);
+		if (ret > 0)
+			t->len = max_t(size_t, t->len, *ppos);
+	}
+	mutex_unlock(&t->lock);
+
+	return ret;
+}
+
+static const struct file_operations bq27x00_trace_data_fops = {
+	.owner = THIS_MODULE,
+	.open = bq27x00_trace_data_open,
+	.read = bq27x00_trace_data_read,
+	.write = bq27x00_trace_data_write,
+	.llseek = default_llseek,
+};
+
+static void bq27x00_trace_init(struct bq27x00_device_info *di)
+{
+	struct bq27x00_trace *t = &di->trace;
+	struct dentry *dir;
+
+	mutex_init(&t->lock);
+	t->speed = 1;
+
+	if (!di->debugfs || !trace_size)
+		return;
+
+	t->buf = vmalloc(trace_size * 1024);
+	if (!t->buf)
+		return;
+
+	dir = debugfs_create_dir("trace", di->debugfs);
+	if (IS_ERR_OR_NULL(dir))
+		return;
+
+	debugfs_create_file("mode", S_IRUSR | S_IWUSR, dir, di,
+			    &bq27x00_trace_mode_fops);
+	debugfs_create_file("data", S_IRUSR | S_IWUSR, dir, di,
+			    &bq27x00_trace_data_fops);
+	debugfs_create_u32("speed", S_IRUSR | S_IWUSR, dir, &t->speed);
+	debugfs_create_u32("dropped", S_IRUSR, dir, &t->dropped);
+	debugfs_create_u32("mismatches", S_IRUSR, dir, &t->mismatches);
+	debugfs_create_u32("uevents", S_IRUSR, dir, &t->uevents);
+	debugfs_create_x32("digest", S_IRUSR, dir, &t->digest);
+}
+
+/* called with the poll work stopped and debugfs gone */
+static void bq27x00_trace_exit(struct bq27x00_device_info *di)
+{
+	vfree(di->trace.buf);
+	mutex_destroy(&di->trace.lock);
+}
+
+
+/*
+ * Scale a raw register value as described by its field.
+ */
+static inline int bq27x00_field_value(const struct bq27x00_field *f, int raw)
+{
+	raw &= f->mask;
+	raw = (raw ^ f->sign) - f->sign;
+
+	return raw * f->mul / f->div;
+}
+
+/*
+ * Read a single register described by a field.
+ * Return < 0 if something fails.
+ */
+static int bq27x00_read_field(struct bq27x00_device_info *di,
+		const struct bq27x00_field *f)
+{
+	int raw;
+
+	raw = bq27x00_read(di, f->reg, f->mask == BQ27x00_BYTE);
+	if (raw < 0) {
+		dev_dbg(di->dev, "error reading register %02x: %d\n",
+			f->reg, raw);
+		return raw;
+	}
+
+	return bq27x00_field_value(f, raw);
+}
+
+/*
+ * Return the battery Nominal available capaciy in uAh
+ * Or < 0 if something fails.
+ */
+static inline int bq27x00_battery_read_nac(struct bq27x00_device_info *di)
+{
+	int nac;
+
+	if (di->cache.flags & BQ27x00_FLAG_CI)
+		return -ENODATA;
+
+	if (!bq27x00_bus_admit(di, BQ27x00_WORD_COST))
+		return bq27x00_last_get(di, BQ27x00_LAST_NAC, &nac) ? nac :
+		       -EAGAIN;
+
+	nac = bq27x00_read_field(di, &di->desc->nac);
+	if (nac >= 0)
+		bq27x00_last_set(di, BQ27x00_LAST_NAC, nac);
+
+	return nac;
+}
+
+/*
+ * Return the battery Initial last measured discharge in uAh
+ * Or < 0 if something fails.
+ */
+static inline int bq27x00_battery_read_dcap(struct bq27x00_device_info *di)
+{
+	return bq27x00_read_field(di, &di->desc->dcap);
+}
+
+/*
+ * Decode health from the flag register.
+ */
+static int bq27x00_battery_health(int flags)
+{
+	if (flags & BQ27x00_FLAG_SOCF)
+		return POWER_SUPPLY_HEALTH_DEAD;
+	else if (flags & BQ27x00_FLAG_OTC)
+		return POWER_SUPPLY_HEALTH_OVERHEAT;
+	else
+		return POWER_SUPPLY_HEALTH_GOOD;
+}
+
+/*
+ * Decode a field out of a register snapshot taken from snap_first on.
+ * Byte fields read one byte past the register, the bulk read plans
+ * leave room for it.
+ */
+static inline int bq27x00_snap_field(const struct bq27x00_chip_desc *d,
+		const struct bq27x00_field *f, const u8 *snap)
+{
+	return bq27x00_field_value(f,
+			get_unaligned_le16(snap + f->reg - d->snap_first));
+}
+
+/*
+ * Rewrite the flags into the bq34z100 layout.
+ */
+static inline int bq27x00_snap_flags(const struct bq27x00_chip_desc *d,
+		const u8 *snap)
+{
+	int raw = bq27x00_snap_field(d, &d->flags, snap);
+	int flags = raw & d->flags_keep;
+	int i;
+
+	for (i = 0; i < BQ27x00_FLAG_MAP_LEN; i++)
+		flags |= -!!(raw & d->flag_map[i].from) & d->flag_map[i].to;
+
+	return flags ^ d->flags_invert;
+}
+
+/*
+ * Return how many MiB the write-back cache can flush on the remaining
+ * battery energy, or -ENODATA if the budget is not configured.
+ */
+static int bq27x00_battery_flush_budget(const struct bq27x00_reg_cache *cache)
+{
+	u64 holdup;
+
+	if (!flush_power || !flush_rate || cache->energy < 0)
+		return -ENODATA;
+
+	/* uWh * 3600 / (mW * 1000) gives seconds */
+	holdup = div_u64((u64)cache->energy * 36, flush_power * 10);
+
+	return min_t(u64, holdup * flush_rate, INT_MAX);
+}
+
+int bq27x00_register_notifier(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_register(&bq27x00_notifier_list, nb);
+}
+EXPORT_SYMBOL_GPL(bq27x00_register_notifier);
+
+int bq27x00_unregister_notifier(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_unregister(&bq27x00_notifier_list, nb);
+}
+EXPORT_SYMBOL_GPL(bq27x00_unregister_notifier);
+
+#define BQ27x00_FLAG_OT		(BQ27x00_FLAG_OTC | BQ27x00_FLAG_OTD)
+
+/*
+ * Work out which events the transition from old to new raised.
+ * Only the two cached snapshots are compared, no bus access is done.
+ */
+static unsigned long bq27x00_events(const struct bq27x00_reg_cache *old,
+		const struct bq27x00_reg_cache *new)
+{
+	unsigned long events = 0;
+	int old_flags = old->flags < 0 ? 0 : old->flags;
+	int raised, cleared;
+
+	if (old->flags >= 0 && new->flags < 0)
+		events |= BQ27x00_EVT_ABSENT;
+	else if (old->flags < 0 && new->flags >= 0)
+		events |= BQ27x00_EVT_PRESENT;
+
+	if (new->flags >= 0) {
+		raised = new->flags & ~old_flags;
+		cleared = old_flags & ~new->flags;
+
+		if (raised & BQ27x00_FLAG_DSG)
+			events |= BQ27x00_EVT_ON_BATTERY;
+		if (cleared & BQ27x00_FLAG_DSG)
+			events |= BQ27x00_EVT_AC_RESTORED;
+		if (raised & BQ27x00_FLAG_SOC1)
+			events |= BQ27x00_EVT_SOC1;
+		if (raised & BQ27x00_FLAG_SOCF)
+			events |= BQ27x00_EVT_SOCF;
+		if (raised & BQ27x00_FLAG_BATLOW)
+			events |= BQ27x00_EVT_BATLOW;
+		if (raised & BQ27x00_FLAG_OT)
+			events |= BQ27x00_EVT_OVERTEMP;
+	}
+
+	if (old->flush_budget != new->flush_budget)
+		events |= BQ27x00_EVT_FLUSH_BUDGET;
+
+	return events;
+}
+
+/* Hand the events to the registered consumers in a single call. */
+static void bq27x00_notify(struct bq27x00_device_info *di,
+		unsigned long events)
+{
+	struct bq27x00_event_data data;
+
+	if (!events)
+		return;
+
+	data.id = di->id;
+	data.name = di->bat.name;
+	data.cache = &di->cache;
+	data.timestamp = ktime_to_ns(di->stamp);
+	data.seq = di->seq;
+
+	blocking_notifier_call_chain(&bq27x00_notifier_list, events, &data);
+}
+
+static void bq27x00_refresh_kick(struct bq27x00_device_info *di,
+		int max_age);
+static int bq27x00_seq_begin(struct bq27x00_device_info *di);
+static inline void bq27x00_seq_end(struct bq27x00_device_info *di);
+static void bq27x00_genl_at_rate_publish(struct bq27x00_device_info *di,
+		int rate, int tte);
+
+/*
+ * AtRate
+ *
+ * The gauge predicts the time to empty at a rate written to AtRate()
+ * with its next update, once a second. Readers are only ever answered
+ * from the memo, which makes repeated what-if queries free. A rate that
+ * is not in it is queued for a work item of its own on system_long_wq,
+ * away from the poll worker other gauges share. That work writes
+ * AtRate(), sleeps for the update and reads AtRateTimeToEmpty(), all
+ * under seq_lock, so it never runs while the gauge is being flashed.
+ * The poll cycles carry on meanwhile; they do not take seq_lock.
+ * The answer goes to the memo and is multicast
+ * as BQ27x00_CMD_AT_RATE. AtRate() takes no part in the snapshot, so
+ * the regular samples are not disturbed.
+ */
+
+#define BQ27x00_AT_RATE_DELAY	1100	/* ms */
+#define BQ27x00_ARTTE_NONE	0xffff	/* not discharging at that rate */
+
+/* Whether a value drifted by delta since the memo was filled, 0: at all */
+static inline bool bq27x00_at_rate_drift(int now, int then,
+		unsigned int delta)
+{
+	return delta ? abs(now - then) >= delta : now != then;
+}
+
+/*
+ * Seconds to empty at rate mA from the memo, or -EAGAIN if it is not
+ * known. capacity and temperature are the current readings. Must be
+ * called with at_rate.lock held.
+ */
+static int bq27x00_at_rate_lookup(struct bq27x00_device_info *di, int rate,
+		int capacity, int temperature)
+{
+	struct bq27x00_at_rate *ar = &di->at_rate;
+	int i;
+
+	if (bq27x00_at_rate_drift(capacity, ar->capacity,
+				  at_rate_soc_delta) ||
+	    bq27x00_at_rate_drift(temperature, ar->temperature,
+				  at_rate_temp_delta)) {
+		for (i = 0; i < BQ27x00_AT_RATE_MEMO; i++)
+			ar->memo[i].valid = false;
+		ar->capacity = capacity;
+		ar->temperature = temperature;
+	}
+
+	for (i = 0; i < BQ27x00_AT_RATE_MEMO; i++)
+		if (ar->memo[i].valid && ar->memo[i].rate == rate)
+			return ar->memo[i].tte;
+
+	return -EAGAIN;
+}
+
+/*
+ * Return the seconds to empty at *rate mA (negative while discharging)
+ * and round *rate to the bucket it is answered for. Never touches the
+ * bus: if the rate is not memoized and ask is set, it is queued for
+ * the gauge and -EINPROGRESS returned, otherwise -EAGAIN.
+ */
+static int bq27x00_at_rate(struct bq27x00_device_info *di, int *rate,
+		bool ask)
+{
+	struct bq27x00_at_rate *ar = &di->at_rate;
+	int size = max(at_rate_bucket, 1U);
+	int bucket, capacity, temperature, i, ret;
+
+	if (!di->desc->ar)
+		return -EOPNOTSUPP;
+	if (!di->ready)
+		return -EAGAIN;
+
+	bucket = (*rate + (*rate < 0 ? -size : size) / 2) / size;
+	if (bucket * size < -32768 || bucket * size > 32767)
+		return -ERANGE;
+	*rate = bucket * size;
+
+	mutex_lock(&di->update_lock);
+	capacity = di->cache.capacity;
+	temperature = di->cache.temperature;
+	mutex_unlock(&di->update_lock);
+
+	mutex_lock(&ar->lock);
+	ret = bq27x00_at_rate_lookup(di, *rate, capacity, temperature);
+	if (ret != -EAGAIN || !ask)
+		goto out;
+
+	ret = -EINPROGRESS;
+	for (i = 0; i < ar->npending; i++)
+		if (ar->pending[i] == *rate)
+			goto out;
+	if (ar->npending == BQ27x00_AT_RATE_MEMO) {
+		ret = -EBUSY;
+		goto out;
+	}
+	ar->pending[ar->npending++] = *rate;
+	queue_work(system_long_wq, &ar->work);
+out:
+	mutex_unlock(&ar->lock);
+
+	return ret;
+}
+
+/* Ask the gauge itself, seconds to empty at rate mA or < 0. */
+static int bq27x00_at_rate_ask(struct bq27x00_device_info *di, int rate)
+{
+	const struct bq27x00_chip_desc *d = di->desc;
+	int ret;
+
+	if (di->suspended)
+		return -EBUSY;
+	if (!bq27x00_bus_admit(di, 2 * BQ27x00_WORD_COST))
+		return -EAGAIN;
+
+	/* the gauge may sit in ROM mode */
+	ret = bq27x00_seq_begin(di);
+	if (ret)
+		return ret;
+
+	ret = bq27x00_write(di, d->ar, (u16)rate, false);
+	if (ret >= 0) {
+		msleep(BQ27x00_AT_RATE_DELAY);
+		ret = bq27x00_read(di, d->arte, false);
+	}
+	bq27x00_seq_end(di);
+	if (ret < 0)
+		return ret;
+
+	return ret == BQ27x00_ARTTE_NONE ? -ENODATA : ret * 60;
+}
+
+static void bq27x00_at_rate_work(struct work_struct *work)
+{
+	struct bq27x00_at_rate *ar =
+		container_of(work, struct bq27x00_at_rate, work);
+	struct bq27x00_device_info *di =
+		container_of(ar, struct bq27x00_device_info, at_rate);
+	struct bq27x00_at_rate_memo *m;
+	int rate, tte;
+
+	mutex_lock(&ar->lock);
+	while (ar->npending) {
+		rate = ar->pending[0];
+		mutex_unlock(&ar->lock);
+
+		tte = bq27x00_at_rate_ask(di, rate);
+
+		mutex_lock(&ar->lock);
+		ar->npending--;
+		memmove(ar->pending, ar->pending + 1,
+			ar->npending * sizeof(ar->pending[0]));
+		if (tte >= 0 || tte == -ENODATA) {
+			m = &ar->memo[ar->next];
+			ar->next = (ar->next + 1) % BQ27x00_AT_RATE_MEMO;
+			m->valid = true;
+			m->rate = rate;
+			m->tte = tte;
+		}
+		mutex_unlock(&ar->lock);
+
+		bq27x00_genl_at_rate_publish(di, rate, tte);
+
+		mutex_lock(&ar->lock);
+	}
+	mutex_unlock(&ar->lock);
+}
+
+/*
+ * Pin every listed gauge for a walk that goes to the bus, so the list
+ * lock is not held while it sleeps. Each gauge is held by in_use, which
+ * remove takes for write once the gauge is off the list. Returns an
+ * array of *nr gauges for bq27x00_put_devices(), or NULL.
+ */
+static struct bq27x00_device_info **bq27x00_get_devices(int *nr)
+{
+	struct bq27x00_device_info **dis, *di;
+	int n = 0;
+
+	mutex_lock(&bq27x00_list_lock);
+	list_for_each_entry(di, &bq27x00_devices, node)
+		n++;
+	dis = kmalloc_array(n ? n : 1, sizeof(*dis), GFP_KERNEL);
+	if (dis) {
+		n = 0;
+		list_for_each_entry(di, &bq27x00_devices, node) {
+			down_read(&di->in_use);
+			dis[n++] = di;
+		}
+	}
+	mutex_unlock(&bq27x00_list_lock);
+
+	*nr = n;
+
+	return dis;
+}
+
+static void bq27x00_put_devices(struct bq27x00_device_info **dis, int nr)
+{
+	while (nr--)
+		up_read(&dis[nr]->in_use);
+	kfree(dis);
+}
+
+/* Pin the gauge with instance number id, like bq27x00_get_devices(). */
+static struct bq27x00_device_info *bq27x00_get_device(u32 id)
+{
+	struct bq27x00_device_info *di;
+
+	mutex_lock(&bq27x00_list_lock);
+	list_for_each_entry(di, &bq27x00_devices, node) {
+		if (di->id == id) {
+			down_read(&di->in_use);
+			mutex_unlock(&bq27x00_list_lock);
+			return di;
+		}
 	}
+	mutex_unlock(&bq27x00_list_lock);
+
+	return NULL;
+}
+
+/* Copy the snapshot out of the way of a concurrent update cycle. */
+static void bq27x00_get_sample(struct bq27x00_device_info *di,
+		struct bq27x00_sample *s)
+{
+	mutex_lock(&di->update_lock);
+	s->cache = di->cache;
+	s->stamp = di->stamp;
+	s->seq = di->seq;
+	mutex_unlock(&di->update_lock);
+}
+
+/*
+ * Generic netlink
+ */
+
+static struct genl_family bq27x00_genl_family = {
+	.id = GENL_ID_GENERATE,
+	.name = BQ27x00_GENL_NAME,
+	.version = BQ27x00_GENL_VERSION,
+	.maxattr = BQ27x00_ATTR_MAX,
+};
+
+static struct genl_multicast_group bq27x00_genl_mcgrp = {
+	.name = BQ27x00_GENL_MCGRP,
+};
+
+static bool bq27x00_genl_registered;
+
+static int bq27x00_genl_fill(struct sk_buff *skb,
+		struct bq27x00_device_info *di, const struct bq27x00_sample *s,
+		unsigned long events, u32 portid, u32 seq, int flags)
+{
+	const struct bq27x00_reg_cache *cache = &s->cache;
+	void *hdr;
+
+	hdr = genlmsg_put(skb, portid, seq, &bq27x00_genl_family, flags,
+			  BQ27x00_CMD_SNAPSHOT);
+	if (!hdr)
+		return -EMSGSIZE;
+
+	if (nla_put_u32(skb, BQ27x00_ATTR_ID, di->id) ||
+	    nla_put_string(skb, BQ27x00_ATTR_NAME, di->bat.name) ||
+	    (events && nla_put_u32(skb, BQ27x00_ATTR_EVENTS, events)) ||
+	    nla_put_u32(skb, BQ27x00_ATTR_FLAGS, cache->flags) ||
+	    nla_put_u32(skb, BQ27x00_ATTR_CAPACITY, cache->capacity) ||
+	    nla_put_u32(skb, BQ27x00_ATTR_TEMP, cache->temperature) ||
+	    nla_put_u32(skb, BQ27x00_ATTR_TIME_TO_EMPTY,
+			cache->time_to_empty) ||
+	    nla_put_u32(skb, BQ27x00_ATTR_TIME_TO_EMPTY_AVG,
+			cache->time_to_empty_avg) ||
+	    nla_put_u32(skb, BQ27x00_ATTR_TIME_TO_FULL,
+			cache->time_to_full) ||
+	    nla_put_u32(skb, BQ27x00_ATTR_CHARGE_FULL, cache->charge_full) ||
+	    nla_put_u32(skb, BQ27x00_ATTR_CYCLE_COUNT, cache->cycle_count) ||
+	    nla_put_u32(skb, BQ27x00_ATTR_ENERGY, cache->energy) ||
+	    nla_put_u32(skb, BQ27x00_ATTR_POWER_AVG, cache->power_avg) ||
+	    nla_put_u32(skb, BQ27x00_ATTR_HEALTH, cache->health) ||
+	    nla_put_u32(skb, BQ27x00_ATTR_FLUSH_BUDGET, cache->flush_budget) ||
+	    nla_put_u64(skb, BQ27x00_ATTR_TIMESTAMP, ktime_to_ns(s->stamp)) ||
+	    nla_put_u32(skb, BQ27x00_ATTR_SEQ, s->seq))
+		goto nla_put_failure;
+
+	return genlmsg_end(skb, hdr);
+
+nla_put_failure:
+	genlmsg_cancel(skb, hdr);
+	return -EMSGSIZE;
+}
+
+/*
+ * Multicast the published snapshot, skipped when nobody listens.
+ * Called from the update cycle, update_lock is held.
+ */
+static void bq27x00_genl_publish(struct bq27x00_device_info *di,
+		unsigned long events)
+{
+	struct bq27x00_sample s = {
+		.cache = di->cache,
+		.stamp = di->stamp,
+		.seq = di->seq,
+	};
+	struct sk_buff *skb;
+
+	if (!bq27x00_genl_registered ||
+	    !netlink_has_listeners(init_net.genl_sock, bq27x00_genl_mcgrp.id))
+		return;
+
+	skb = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+	if (!skb)
+		return;
+
+	if (bq27x00_genl_fill(skb, di, &s, events, 0, 0, 0) < 0) {
+		nlmsg_free(skb);
+		return;
+	}
+
+	genlmsg_multicast(skb, 0, bq27x00_genl_mcgrp.id, GFP_KERNEL);
+}
+
+static const struct nla_policy bq27x00_genl_policy[BQ27x00_ATTR_MAX + 1] = {
+	[BQ27x00_ATTR_MAX_AGE] = { .type = NLA_U32 },
+	[BQ27x00_ATTR_ID] = { .type = NLA_U32 },
+	[BQ27x00_ATTR_AT_RATE] = { .type = NLA_U32 },
+};
+
+/*
+ * Dump the current snapshot of every gauge. No history is kept by
+ * the driver, so this is all there is. cb->args[0] is the number of
+ * gauges already sent, cb->args[1] the requested max age plus one.
+ * The dump runs under genl_lock and never waits for the bus: gauges
+ * older than the max age get a sample queued, which is multicast when
+ * it changes anything, and the dump answers from the cache.
+ */
+static int bq27x00_genl_dump(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	struct nlattr *attrs[BQ27x00_ATTR_MAX + 1];
+	struct bq27x00_device_info **dis;
+	struct bq27x00_sample s;
+	int idx, nr;
+
+	if (!cb->args[0] && !cb->args[1] &&
+	    !nlmsg_parse(cb->nlh, GENL_HDRLEN, attrs, BQ27x00_ATTR_MAX,
+			 bq27x00_genl_policy) &&
+	    attrs[BQ27x00_ATTR_MAX_AGE])
+		cb->args[1] = nla_get_u32(attrs[BQ27x00_ATTR_MAX_AGE]) + 1;
+
+	dis = bq27x00_get_devices(&nr);
+	if (!dis)
+		return -ENOMEM;
+
+	for (idx = cb->args[0]; idx < nr; idx++) {
+		if (cb->args[1])
+			bq27x00_refresh_kick(dis[idx], cb->args[1] - 1);
+		bq27x00_get_sample(dis[idx], &s);
+		if (bq27x00_genl_fill(skb, dis[idx], &s, 0,
+				      NETLINK_CB(cb->skb).portid,
+				      cb->nlh->nlmsg_seq, NLM_F_MULTI) < 0)
+			break;
+	}
+	bq27x00_put_devices(dis, nr);
+
+	cb->args[0] = idx;
+
+	return skb->len;
+}
+
+static int bq27x00_genl_at_rate_fill(struct sk_buff *skb, u32 id, int rate,
+		int tte)
+{
+	if (nla_put_u32(skb, BQ27x00_ATTR_ID, id) ||
+	    nla_put_u32(skb, BQ27x00_ATTR_AT_RATE, rate) ||
+	    (tte != -EINPROGRESS &&
+	     nla_put_u32(skb, BQ27x00_ATTR_AT_RATE_TTE, tte)))
+		return -EMSGSIZE;
+
+	return 0;
+}
+
+/* Multicast the answer of the gauge to a queued AtRate query. */
+static void bq27x00_genl_at_rate_publish(struct bq27x00_device_info *di,
+		int rate, int tte)
+{
+	struct sk_buff *skb;
+	void *hdr;
+
+	if (!bq27x00_genl_registered ||
+	    !netlink_has_listeners(init_net.genl_sock, bq27x00_genl_mcgrp.id))
+		return;
+
+	skb = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+	if (!skb)
+		return;
+
+	hdr = genlmsg_put(skb, 0, 0, &bq27x00_genl_family, 0,
+			  BQ27x00_CMD_AT_RATE);
+	if (!hdr || bq27x00_genl_at_rate_fill(skb, di->id, rate, tte)) {
+		nlmsg_free(skb);
+		return;
+	}
+	genlmsg_end(skb, hdr);
+
+	genlmsg_multicast(skb, 0, bq27x00_genl_mcgrp.id, GFP_KERNEL);
+}
+
+/*
+ * Answer from the memo. A rate the gauge has to be asked about is
+ * acknowledged without BQ27x00_ATTR_AT_RATE_TTE; the answer follows as
+ * a multicast once the gauge has updated.
+ */
+static int bq27x00_genl_at_rate(struct sk_buff *skb, struct genl_info *info)
+{
+	struct bq27x00_device_info *di;
+	struct sk_buff *msg;
+	void *hdr;
+	u32 id;
+	int rate, tte;
+
+	if (!info->attrs[BQ27x00_ATTR_ID] || !info->attrs[BQ27x00_ATTR_AT_RATE])
+		return -EINVAL;
+	id = nla_get_u32(info->attrs[BQ27x00_ATTR_ID]);
+	rate = (s32)nla_get_u32(info->attrs[BQ27x00_ATTR_AT_RATE]);
+
+	di = bq27x00_get_device(id);
+	if (!di)
+		return -ENODEV;
+	tte = bq27x00_at_rate(di, &rate, true);
+	up_read(&di->in_use);
+	if (tte < 0 && tte != -ENODATA && tte != -EINPROGRESS)
+		return tte;
+
+	msg = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+	if (!msg)
+		return -ENOMEM;
+
+	hdr = genlmsg_put_reply(msg, info, &bq27x00_genl_family, 0,
+				BQ27x00_CMD_AT_RATE);
+	if (!hdr || bq27x00_genl_at_rate_fill(msg, id, rate, tte)) {
+		nlmsg_free(msg);
+		return -EMSGSIZE;
+	}
+	genlmsg_end(msg, hdr);
+
+	return genlmsg_reply(msg, info);
+}
+
+static struct genl_ops bq27x00_genl_ops[] = {
+	{
+		.cmd = BQ27x00_CMD_GET,
+		.policy = bq27x00_genl_policy,
+		.dumpit = bq27x00_genl_dump,
+	},
+	{
+		.cmd = BQ27x00_CMD_AT_RATE,
+		.policy = bq27x00_genl_policy,
+		.doit = bq27x00_genl_at_rate,
+	},
+};
+
+static void bq27x00_genl_init(void)
+{
+	int ret;
+
+	ret = genl_register_family_with_ops(&bq27x00_genl_family,
+			bq27x00_genl_ops, ARRAY_SIZE(bq27x00_genl_ops));
+	if (ret) {
+		pr_err("bq34z100: cannot register netlink family: %d\n", ret);
+		return;
+	}
+
+	ret = genl_register_mc_group(&bq27x00_genl_family, &bq27x00_genl_mcgrp);
+	if (ret) {
+		pr_err("bq34z100: cannot register netlink group: %d\n", ret);
+		genl_unregister_family(&bq27x00_genl_family);
+		return;
+	}
+
+	bq27x00_genl_registered = true;
+}
+
+static void bq27x00_genl_exit(void)
+{
+	if (bq27x00_genl_registered)
+		genl_unregister_family(&bq27x00_genl_family);
+}
+
+/*
+ * Aggregated pack
+ *
+ * The totals are kept up to date incrementally: when a gauge publishes,
+ * its previous contribution is taken out and the new one added, so
+ * reading the pack never walks the gauges or touches the bus. Worst
+ * health and flags are kept as per-value counts for the same reason.
+ */
+
+#define BQ27x00_PACK_FLAG_BITS	16
+
+static const int bq27x00_pack_health[] = {
+	POWER_SUPPLY_HEALTH_GOOD,
+	POWER_SUPPLY_HEALTH_OVERHEAT,
+	POWER_SUPPLY_HEALTH_DEAD,
+};
+
+static struct bq27x00_pack {
+	struct power_supply psy;
+	struct mutex lock;
+	bool registered;
+
+	int members;
+	s64 charge_full;
+	s64 charge_now;		/* capacity weighted by charge_full */
+	s64 energy;
+	s64 power;
+	int health_count[ARRAY_SIZE(bq27x00_pack_health)];
+	int flag_count[BQ27x00_PACK_FLAG_BITS];
+	int budget_members;
+	int flush_budget;
+} bq27x00_pack;
+
+static int bq27x00_pack_health_rank(int health)
+{
+	int i;
+
+	for (i = ARRAY_SIZE(bq27x00_pack_health) - 1; i > 0; i--)
+		if (bq27x00_pack_health[i] == health)
+			break;
+
+	return i;
+}
+
+static void bq27x00_pack_part(const struct bq27x00_reg_cache *cache,
+		struct bq27x00_pack_part *part)
+{
+	memset(part, 0, sizeof(*part));
+
+	if (cache->flags < 0)
+		return;
+
+	part->valid = true;
+	part->charge_full = max(cache->charge_full, 0);
+	part->capacity = max(cache->capacity, 0);
+	part->energy = max(cache->energy, 0);
+	part->power = cache->power_avg == -ENODATA ? 0 : cache->power_avg;
+	part->health_rank = bq27x00_pack_health_rank(cache->health);
+	part->flags = cache->flags;
+	part->flush_budget = cache->flush_budget;
+}
+
+/* Add (sign = 1) or take out (sign = -1) one contribution. */
+static void bq27x00_pack_account(struct bq27x00_pack *p,
+		const struct bq27x00_pack_part *part, int sign)
+{
+	int i;
+
+	if (!part->valid)
+		return;
+
+	p->members += sign;
+	p->charge_full += sign * (s64)part->charge_full;
+	p->charge_now += sign * (s64)part->charge_full * part->capacity;
+	p->energy += sign * (s64)part->energy;
+	p->power += sign * (s64)part->power;
+	p->health_count[part->health_rank] += sign;
+
+	for (i = 0; i < BQ27x00_PACK_FLAG_BITS; i++)
+		if (part->flags & BIT(i))
+			p->flag_count[i] += sign;
+
+	if (part->flush_budget >= 0) {
+		p->budget_members += sign;
+		p->flush_budget += sign * part->flush_budget;
+	}
+}
+
+/* Replace the contribution of di with its current snapshot. */
+static void bq27x00_pack_update(struct bq27x00_device_info *di)
+{
+	struct bq27x00_pack *p = &bq27x00_pack;
+	struct bq27x00_pack_part part;
+
+	if (!p->registered)
+		return;
+
+	bq27x00_pack_part(&di->cache, &part);
+
+	mutex_lock(&p->lock);
+	bq27x00_pack_account(p, &di->pack_part, -1);
+	bq27x00_pack_account(p, &part, 1);
+	di->pack_part = part;
+	mutex_unlock(&p->lock);
+
+	power_supply_changed(&p->psy);
+}
+
+static void bq27x00_pack_leave(struct bq27x00_device_info *di)
+{
+	struct bq27x00_pack *p = &bq27x00_pack;
+
+	if (!p->registered)
+		return;
+
+	mutex_lock(&p->lock);
+	bq27x00_pack_account(p, &di->pack_part, -1);
+	memset(&di->pack_part, 0, sizeof(di->pack_part));
+	mutex_unlock(&p->lock);
+
+	power_supply_changed(&p->psy);
+}
+
+/* OR of the flags of all members */
+static int bq27x00_pack_flags(const struct bq27x00_pack *p)
+{
+	int i, flags = 0;
+
+	for (i = 0; i < BQ27x00_PACK_FLAG_BITS; i++)
+		if (p->flag_count[i])
+			flags |= BIT(i);
+
+	return flags;
+}
+
+static int bq27x00_pack_get_property(struct power_supply *psy,
+					enum power_supply_property psp,
+					union power_supply_propval *val)
+{
+	struct bq27x00_pack *p = container_of(psy, struct bq27x00_pack, psy);
+	int i, flags, ret = 0;
+
+	mutex_lock(&p->lock);
+
+	if (psp != POWER_SUPPLY_PROP_PRESENT && !p->members) {
+		ret = -ENODATA;
+		goto out;
+	}
+
+	flags = bq27x00_pack_flags(p);
+
+	switch (psp) {
+	case POWER_SUPPLY_PROP_PRESENT:
+		val->intval = p->members > 0;
+		break;
+	case POWER_SUPPLY_PROP_STATUS:
+		/* full only when every member is */
+		if (p->flag_count[__ffs(BQ27x00_FLAG_FC)] == p->members)
+			val->intval = POWER_SUPPLY_STATUS_FULL;
+		else if (flags & BQ27x00_FLAG_DSG)
+			val->intval = POWER_SUPPLY_STATUS_DISCHARGING;
+		else
+			val->intval = POWER_SUPPLY_STATUS_CHARGING;
+		break;
+	case POWER_SUPPLY_PROP_CAPACITY:
+		if (p->charge_full <= 0) {
+			ret = -ENODATA;
+			break;
+		}
+		val->intval = div64_s64(p->charge_now, p->charge_full);
+		break;
+	case POWER_SUPPLY_PROP_CAPACITY_LEVEL:
+		if (flags & BQ27x00_FLAG_SOCF)
+			val->intval = POWER_SUPPLY_CAPACITY_LEVEL_CRITICAL;
+		else if (flags & BQ27x00_FLAG_SOC1)
+			val->intval = POWER_SUPPLY_CAPACITY_LEVEL_LOW;
+		else if (p->flag_count[__ffs(BQ27x00_FLAG_FC)] == p->members)
+			val->intval = POWER_SUPPLY_CAPACITY_LEVEL_FULL;
+		else
+			val->intval = POWER_SUPPLY_CAPACITY_LEVEL_NORMAL;
+		break;
+	case POWER_SUPPLY_PROP_TECHNOLOGY:
+		val->intval = POWER_SUPPLY_TECHNOLOGY_LION;
+		break;
+	case POWER_SUPPLY_PROP_CHARGE_FULL:
+		val->intval = p->charge_full;
+		break;
+	case POWER_SUPPLY_PROP_CHARGE_NOW:
+		val->intval = div_s64(p->charge_now, 100);
+		break;
+	case POWER_SUPPLY_PROP_ENERGY_NOW:
+		val->intval = p->energy;
+		break;
+	case POWER_SUPPLY_PROP_POWER_AVG:
+		val->intval = p->power;
+		break;
+	case POWER_SUPPLY_PROP_TIME_TO_EMPTY_NOW:
+		/* Unit: second, from total energy over total power */
+		if (p->power >= 0) {
+			ret = -ENODATA;
+			break;
+		}
+		val->intval = div64_s64(p->energy * 3600, -p->power);
+		break;
+	case POWER_SUPPLY_PROP_HEALTH:
+		for (i = ARRAY_SIZE(bq27x00_pack_health) - 1; i > 0; i--)
+			if (p->health_count[i])
+				break;
+		val->intval = bq27x00_pack_health[i];
+		break;
+	default:
+		ret = -EINVAL;
+	}
+
+out:
+	mutex_unlock(&p->lock);
+
+	return ret;
+}
+
+static enum power_supply_property bq27x00_pack_props[] = {
+	POWER_SUPPLY_PROP_STATUS,
+	POWER_SUPPLY_PROP_PRESENT,
+	POWER_SUPPLY_PROP_CAPACITY,
+	POWER_SUPPLY_PROP_CAPACITY_LEVEL,
+	POWER_SUPPLY_PROP_TIME_TO_EMPTY_NOW,
+	POWER_SUPPLY_PROP_TECHNOLOGY,
+	POWER_SUPPLY_PROP_CHARGE_FULL,
+	POWER_SUPPLY_PROP_CHARGE_NOW,
+	POWER_SUPPLY_PROP_ENERGY_NOW,
+	POWER_SUPPLY_PROP_POWER_AVG,
+	POWER_SUPPLY_PROP_HEALTH,
+};
+
+/*
+ * The combined flush budget is not a power supply property, it is
+ * exported as an attribute of the pack device.
+ */
+static ssize_t show_pack_flush_budget(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct bq27x00_pack *p = &bq27x00_pack;
+	ssize_t ret;
+
+	mutex_lock(&p->lock);
+	if (p->budget_members)
+		ret = sprintf(buf, "%d\n", p->flush_budget);
+	else
+		ret = -ENODATA;
+	mutex_unlock(&p->lock);
+
+	return ret;
+}
+
+static ssize_t show_pack_flags(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct bq27x00_pack *p = &bq27x00_pack;
+	int flags;
+
+	mutex_lock(&p->lock);
+	flags = bq27x00_pack_flags(p);
+	mutex_unlock(&p->lock);
+
+	return sprintf(buf, "0x%04x\n", flags);
+}
+
+static DEVICE_ATTR(flush_budget, S_IRUGO, show_pack_flush_budget, NULL);
+static DEVICE_ATTR(flags, S_IRUGO, show_pack_flags, NULL);
+
+static struct attribute *bq27x00_pack_attributes[] = {
+	&dev_attr_flush_budget.attr,
+	&dev_attr_flags.attr,
+	NULL
+};
+
+static const struct attribute_group bq27x00_pack_attr_group = {
+	.attrs = bq27x00_pack_attributes,
+};
+
+static void bq27x00_pack_init(void)
+{
+	struct bq27x00_pack *p = &bq27x00_pack;
+	int ret;
+
+	if (!pack)
+		return;
+
+	mutex_init(&p->lock);
+	p->psy.name = "bq27x00-pack";
+	p->psy.type = POWER_SUPPLY_TYPE_BATTERY;
+	p->psy.properties = bq27x00_pack_props;
+	p->psy.num_properties = ARRAY_SIZE(bq27x00_pack_props);
+	p->psy.get_property = bq27x00_pack_get_property;
+
+	ret = power_supply_register(NULL, &p->psy);
+	if (ret) {
+		pr_err("bq34z100: failed to register pack: %d\n", ret);
+		return;
+	}
+
+	if (sysfs_create_group(&p->psy.dev->kobj, &bq27x00_pack_attr_group))
+		pr_err("bq34z100: could not create pack sysfs files\n");
+
+	p->registered = true;
+}
+
+static void bq27x00_pack_exit(void)
+{
+	struct bq27x00_pack *p = &bq27x00_pack;
+
+	if (!p->registered)
+		return;
+
+	sysfs_remove_group(&p->psy.dev->kobj, &bq27x00_pack_attr_group);
+	power_supply_unregister(&p->psy);
+	p->registered = false;
+}
+
+/*
+ * IIO
+ *
+ * The gauge is also an IIO device, so load characterization can stream
+ * it with the usual IIO tools. Every sample of the update cycle goes
+ * into a kfifo buffer, stamped with the snapshot time. Values are the
+ * decoded ones, scale brings them to IIO units.
+ */
+
+#if IS_ENABLED(CONFIG_IIO_KFIFO_BUF)
+enum bq27x00_iio_scan {
+	BQ27x00_IIO_VOLTAGE,
+	BQ27x00_IIO_CURRENT,
+	BQ27x00_IIO_POWER,
+	BQ27x00_IIO_TEMP,
+	BQ27x00_IIO_SOC,
+	BQ27x00_IIO_TIMESTAMP,
+};
+
+#define BQ27x00_IIO_CHAN(_type, _index, _info) {			\
+	.type = _type,							\
+	.indexed = 1,							\
+	.channel = _index,						\
+	.info_mask = IIO_CHAN_INFO_RAW_SEPARATE_BIT | (_info),		\
+	.scan_index = _index,						\
+	.scan_type = { .sign = 's', .realbits = 32, .storagebits = 32 },\
+}
+
+/*
+ * There is no IIO channel type for a ratio, the state of charge is a
+ * voltage channel of its own name, in percent.
+ */
+static const struct iio_chan_spec bq27x00_iio_channels[] = {
+	BQ27x00_IIO_CHAN(IIO_VOLTAGE, BQ27x00_IIO_VOLTAGE,
+			 IIO_CHAN_INFO_SCALE_SEPARATE_BIT),
+	BQ27x00_IIO_CHAN(IIO_CURRENT, BQ27x00_IIO_CURRENT,
+			 IIO_CHAN_INFO_SCALE_SEPARATE_BIT),
+	BQ27x00_IIO_CHAN(IIO_POWER, BQ27x00_IIO_POWER,
+			 IIO_CHAN_INFO_SCALE_SEPARATE_BIT),
+	BQ27x00_IIO_CHAN(IIO_TEMP, BQ27x00_IIO_TEMP,
+			 IIO_CHAN_INFO_SCALE_SEPARATE_BIT |
+			 IIO_CHAN_INFO_OFFSET_SEPARATE_BIT),
+	{
+		.type = IIO_VOLTAGE,
+		.indexed = 1,
+		.channel = BQ27x00_IIO_SOC,
+		.extend_name = "soc",
+		.info_mask = IIO_CHAN_INFO_RAW_SEPARATE_BIT,
+		.scan_index = BQ27x00_IIO_SOC,
+		.scan_type = { .sign = 's', .realbits = 32, .storagebits = 32 },
+	},
+	IIO_CHAN_SOFT_TIMESTAMP(BQ27x00_IIO_TIMESTAMP),
+};
+
+/* every sample carries all channels, the core demuxes what is enabled */
+static const unsigned long bq27x00_iio_scan_masks[] = {
+	BIT(BQ27x00_IIO_SOC + 1) - 1,
+	0
+};
+
+/* one scan as pushed into the buffer */
+struct bq27x00_iio_scan_data {
+	s32 value[BQ27x00_IIO_SOC + 1];
+	s32 pad;
+	s64 timestamp;
+};
+
+/*
+ * Value of channel index, or -EAGAIN if it has not been read yet,
+ * -ENODEV if the gauge stopped answering and -ENODATA if it does not
+ * report it. The current and the power are signed, elsewhere < 0 is
+ * -ENODATA.
+ */
+static int bq27x00_iio_value(struct bq27x00_device_info *di, int index,
+		int *val)
+{
+	if (di->cache.flags < 0)
+		return -ENODEV;
+
+	switch (index) {
+	case BQ27x00_IIO_VOLTAGE:
+		if (!bq27x00_last_get(di, BQ27x00_LAST_VOLT, val))
+			return -EAGAIN;
+		break;
+	case BQ27x00_IIO_CURRENT:
+		return bq27x00_last_get(di, BQ27x00_LAST_CURR, val) ?
+		       0 : -EAGAIN;
+	case BQ27x00_IIO_POWER:
+		*val = di->cache.power_avg;
+		return *val == -ENODATA ? -ENODATA : 0;
+	case BQ27x00_IIO_TEMP:
+		*val = di->cache.temperature;
+		break;
+	default:
+		*val = di->cache.capacity;
+		break;
+	}
+
+	return *val < 0 ? *val : 0;
+}
+
+static int bq27x00_iio_read_raw(struct iio_dev *indio_dev,
+		struct iio_chan_spec const *chan, int *val, int *val2,
+		long mask)
+{
+	struct bq27x00_device_info *di =
+		*(struct bq27x00_device_info **)iio_priv(indio_dev);
+	int ret;
+
+	switch (mask) {
+	case IIO_CHAN_INFO_RAW:
+		if (!di->ready)
+			return -EAGAIN;
+		ret = bq27x00_iio_value(di, chan->scan_index, val);
+		if (ret)
+			return ret;
+		return IIO_VAL_INT;
+	case IIO_CHAN_INFO_SCALE:
+		/* uV, uA, uW to mV, mA, mW; 0.1 K to milli degrees */
+		if (chan->type == IIO_TEMP) {
+			*val = 100;
+			return IIO_VAL_INT;
+		}
+		*val = 0;
+		*val2 = 1000;
+		return IIO_VAL_INT_PLUS_MICRO;
+	case IIO_CHAN_INFO_OFFSET:
+		/* -273.15 C in 0.1 K */
+		*val = 2731;
+		*val2 = -500000;
+		return IIO_VAL_INT_PLUS_MICRO;
+	default:
+		return -EINVAL;
+	}
+}
+
+static const struct iio_info bq27x00_iio_info = {
+	.driver_module = THIS_MODULE,
+	.read_raw = bq27x00_iio_read_raw,
+};
+
+/*
+ * Called from the update cycle once a fresh sample is in the cache. The
+ * buffer has a single scan mask, so a sample that lacks any channel is
+ * not pushed at all rather than carrying an errno as a reading.
+ */
+static void bq27x00_iio_push(struct bq27x00_device_info *di)
+{
+	struct bq27x00_iio_scan_data scan;
+	int i;
+
+	if (!di->iio || !iio_buffer_enabled(di->iio))
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(scan.value); i++)
+		if (bq27x00_iio_value(di, i, &scan.value[i]))
+			return;
+	scan.pad = 0;
+	scan.timestamp = ktime_to_ns(di->stamp);
+
+	iio_push_to_buffers(di->iio, (u8 *)&scan);
+}
+
+/* Like debugfs, IIO is optional: failing here only loses the stream. */
+static void bq27x00_iio_init(struct bq27x00_device_info *di)
+{
+	struct iio_dev *indio_dev;
+	int ret;
+
+	indio_dev = iio_device_alloc(sizeof(di));
+	if (!indio_dev)
+		return;
+
+	*(struct bq27x00_device_info **)iio_priv(indio_dev) = di;
+	indio_dev->dev.parent = di->dev;
+	indio_dev->name = di->bat.name;
+	indio_dev->info = &bq27x00_iio_info;
+	indio_dev->channels = bq27x00_iio_channels;
+	indio_dev->num_channels = ARRAY_SIZE(bq27x00_iio_channels);
+	indio_dev->available_scan_masks = bq27x00_iio_scan_masks;
+	indio_dev->modes = INDIO_DIRECT_MODE | INDIO_BUFFER_SOFTWARE;
+
+	indio_dev->buffer = iio_kfifo_allocate(indio_dev);
+	if (!indio_dev->buffer) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	ret = iio_buffer_register(indio_dev, bq27x00_iio_channels,
+				  ARRAY_SIZE(bq27x00_iio_channels));
+	if (ret)
+		goto err_kfifo;
+
+	ret = iio_device_register(indio_dev);
+	if (ret)
+		goto err_buffer;
+
+	di->iio = indio_dev;
+
+	return;
+
+err_buffer:
+	iio_buffer_unregister(indio_dev);
+err_kfifo:
+	iio_kfifo_free(indio_dev->buffer);
+err_free:
+	iio_device_free(indio_dev);
+	dev_warn(di->dev, "no IIO device: %d\n", ret);
+}
+
+static void bq27x00_iio_exit(struct bq27x00_device_info *di)
+{
+	struct iio_dev *indio_dev = di->iio;
+
+	if (!indio_dev)
+		return;
+
+	di->iio = NULL;
+	iio_device_unregister(indio_dev);
+	iio_buffer_unregister(indio_dev);
+	iio_kfifo_free(indio_dev->buffer);
+	iio_device_free(indio_dev);
+}
+#else
+static inline void bq27x00_iio_push(struct bq27x00_device_info *di)
+{
+}
+
+static inline void bq27x00_iio_init(struct bq27x00_device_info *di)
+{
+}
+
+static inline void bq27x00_iio_exit(struct bq27x00_device_info *di)
+{
+}
+#endif
+
+/*
+ * Publish a new snapshot to every consumer: power supply class,
+ * aggregated pack, in-kernel notifier and netlink listeners.
+ */
+static void bq27x00_publish(struct bq27x00_device_info *di,
+		const struct bq27x00_reg_cache *old)
+{
+	unsigned long events = 0;
+
+	/* the first sample has nothing to diff against, it is no transition */
+	if (di->ready)
+		events = bq27x00_events(old, &di->cache);
+
+	power_supply_changed(&di->bat);
+	bq27x00_trace_uevent(di, &di->cache);
+	bq27x00_pack_update(di);
+	bq27x00_notify(di, events);
+	bq27x00_genl_publish(di, events);
+}
+
+static void bq27x00_render(struct bq27x00_device_info *di);
+
+/*
+ * Read the snapshot block, trying for a consistent cut. A block read
+ * that straddles the once a second refresh of the gauge mixes two
+ * samples. The head of the block, up to voltage, current or
+ * temperature, is read again right after it, and a block whose head
+ * differs is read again. This catches a refresh between the two reads
+ * of the head only if one of those registers moved with it; a refresh
+ * that leaves them alone, or one while the tail went out that the head
+ * does not show, passes unnoticed. It narrows torn samples down, it
+ * does not rule them out.
+ * Called with update_lock held, which also guards the counters.
+ * Return 0, 1 if it stayed torn after consistent_cut reads, or < 0.
+ */
+static int bq27x00_read_snap(struct bq27x00_device_info *di, u8 *snap)
+{
+	const struct bq27x00_chip_desc *d = di->desc;
+	u8 check[BQ27x00_CUT_MAX];
+	int tries, ret;
+
+	for (tries = 0; ; tries++) {
+		ret = bq27x00_read_bulk(di, d->snap_first, snap, d->snap_len);
+		if (ret < 0 || !consistent_cut || !d->cut_len)
+			return ret;
+
+		ret = bq27x00_read_bulk(di, d->snap_first, check, d->cut_len);
+		if (ret < 0)
+			return ret;
+
+		if (!memcmp(check, snap, d->cut_len))
+			return 0;
+
+		if (tries >= consistent_cut) {
+			di->cut_torn++;
+			return 1;
+		}
+		di->cut_retries++;
+	}
+}
+
+/* fields a chip does not have stay at -ENODATA */
+static const struct bq27x00_reg_cache bq27x00_cache_nodata = {
+	.temperature = -ENODATA,
+	.time_to_empty = -ENODATA,
+	.time_to_empty_avg = -ENODATA,
+	.time_to_full = -ENODATA,
+	.charge_full = -ENODATA,
+	.cycle_count = -ENODATA,
+	.capacity = -ENODATA,
+	.energy = -ENODATA,
+	.power_avg = -ENODATA,
+	.health = -ENODATA,
+	.state_of_health = -ENODATA,
+	.internal_temp = -ENODATA,
+	.charge_voltage = -ENODATA,
+	.charge_current = -ENODATA,
+	.max_load_current = -ENODATA,
+	.max_load_tte = -ENODATA,
+	.standby_current = -ENODATA,
+	.standby_tte = -ENODATA,
+	.passed_charge = -ENODATA,
+	.remaining_capacity = -ENODATA,
+};
+
+/*
+ * PassedCharge() moves with every coulomb through the pack, so a change
+ * of it alone is no reason to publish; it is kept current in the cache
+ * without bumping seq.
+ */
+static bool bq27x00_cache_changed(const struct bq27x00_reg_cache *old,
+		const struct bq27x00_reg_cache *new)
+{
+	struct bq27x00_reg_cache cmp = *new;
+
+	cmp.passed_charge = old->passed_charge;
+
+	return memcmp(old, &cmp, sizeof(cmp)) != 0;
+}
+
+/*
+ * Take a new sample. All standard commands come in with a single block
+ * read, checked by a short second one (see bq27x00_read_snap()), so a
+ * sample costs two bus transactions. Decoding walks the
+ * chip's field table, there is no per-chip code on this path.
+ * Return true if the snapshot changed and was published.
+ */
+static bool bq27x00_update(struct bq27x00_device_info *di)
+{
+	const struct bq27x00_chip_desc *d = di->desc;
+	struct bq27x00_reg_cache cache = di->cache;
+	struct bq27x00_reg_cache old;
+	u8 snap[BQ27x00_SNAP_MAX];
+	bool changed = false;
+	int i, ret, curr;
+
+	/* the gauge may sit in ROM mode, keep the last good values */
+	if (di->flash.active || di->suspended)
+		return false;
+
+	ret = bq27x00_read_snap(di, snap);
+	if (ret > 0) {
+		/* keep the last consistent snapshot, the next poll retries */
+		dev_dbg(di->dev, "torn snapshot dropped\n");
+		return false;
+	} else if (ret < 0) {
+		dev_dbg(di->dev, "error reading registers: %d\n", ret);
+		cache.flags = ret;
+	} else {
+		cache = bq27x00_cache_nodata;
+		cache.flags = bq27x00_snap_flags(d, snap);
+
+		for (i = 0; i < d->num_fields; i++)
+			*(int *)((u8 *)&cache + d->fields[i].dest) =
+				bq27x00_snap_field(d, &d->fields[i], snap);
+
+		cache.health = bq27x00_battery_health(cache.flags);
+
+		/* the block covers voltage and current as well */
+		curr = bq27x00_snap_field(d, &d->ai, snap);
+		/* the bq27000 reports the magnitude, CHGS gives the sign */
+		if (d->ai_charge_sign && !(cache.flags & BQ27x00_FLAG_DSG))
+			curr = -curr;
+		/* power is negative while discharging, as on the others */
+		if (d->ai_charge_sign && (cache.flags & BQ27x00_FLAG_DSG) &&
+		    cache.power_avg > 0)
+			cache.power_avg = -cache.power_avg;
+		bq27x00_last_set(di, BQ27x00_LAST_VOLT,
+				 bq27x00_snap_field(d, &d->volt, snap));
+		bq27x00_last_set(di, BQ27x00_LAST_CURR, curr);
+
+		if (cache.flags & BQ27x00_FLAG_CI) {
+			dev_info(di->dev, "battery is not calibrated! ignoring capacity values\n");
+			cache.capacity = -ENODATA;
+			cache.energy = -ENODATA;
+			cache.time_to_empty = -ENODATA;
+			cache.time_to_empty_avg = -ENODATA;
+			cache.time_to_full = -ENODATA;
+			cache.charge_full = -ENODATA;
+			cache.health = -ENODATA;
+		}
+
+		/* We only have to read charge design full once */
+		if (di->charge_design_full <= 0)
+			di->charge_design_full = bq27x00_battery_read_dcap(di);
+	}
+	cache.flush_budget = cache.flags < 0 ? -ENODATA :
+				bq27x00_battery_flush_budget(&cache);
+
+	di->stamp = ktime_get();
+
+	if (bq27x00_cache_changed(&di->cache, &cache)) {
+		old = di->cache;
+		di->cache = cache;
+		di->seq++;
+		bq27x00_publish(di, &old);
+		changed = true;
+	} else {
+		di->cache.passed_charge = cache.passed_charge;
+	}
+
+	if (ret >= 0)
+		bq27x00_iio_push(di);
+
+	/* the timestamp moves even when nothing else does */
+	bq27x00_render(di);
+
+	return changed;
+}
+
+static void bq27x00_read_identity(struct bq27x00_device_info *di);
+
+/*
+ * Probe does not touch the bus at all, the identity and the first
+ * sample are taken here, from the poll work. Userspace learns that the
+ * values are valid from the BQ27X00_READY=1 change uevent.
+ */
+static void bq27x00_battery_first_sample(struct bq27x00_device_info *di)
+{
+	char *envp[] = { "BQ27X00_READY=1", NULL };
+
+	bq27x00_read_identity(di);
+
+	if (di->desc->control)
+		dev_info(di->dev,
+			"Gas Guage fw version 0x%04x; df version 0x%04x\n",
+			di->ident.fw_version, di->ident.df_version);
+
+	bq27x00_update(di);
+	di->ready = true;
+
+	kobject_uevent_env(&di->bat.dev->kobj, KOBJ_CHANGE, envp);
+	bq27x00_trace_uevent(di, NULL);
+}
+
+static void bq27x00_battery_poll(struct kthread_work *work)
+{
+	struct bq27x00_device_info *di =
+		container_of(work, struct bq27x00_device_info, work);
+	unsigned long delay;
+
+	/*
+	 * The work and forced refreshes or resume may sample at once,
+	 * only one of them updates the snapshot at a time.
+	 */
+	mutex_lock(&di->update_lock);
+	if (!di->ready)
+		bq27x00_battery_first_sample(di);
+	else
+		bq27x00_update(di);
+	mutex_unlock(&di->update_lock);
+
+	if (bq27x00_poll_delay(di, &delay)) {
+		/* The timer does not have to be accurate. */
+#if 0
+		set_timer_slack(&di->poll_timer, poll_interval * HZ / 4);
+#endif
+		bq27x00_schedule_poll(di, delay);
+	}
+}
+
+/*
+ * Return the battery average current in uA
+ * Note that current can be negative signed as well
+ * Or 0 if something fails.
+ */
+static int bq27x00_battery_current(struct bq27x00_device_info *di,
+	union power_supply_propval *val)
+{
+	const struct bq27x00_field *f = &di->desc->ai;
+	int curr;
+
+	if (!bq27x00_bus_admit(di, BQ27x00_WORD_COST)) {
+		if (!bq27x00_last_get(di, BQ27x00_LAST_CURR, &curr))
+			return -EAGAIN;
+		val->intval = curr;
+		return 0;
+	}
+
+	/* read raw, a decoded negative current is not an error */
+	curr = bq27x00_read(di, f->reg, false);
+	if (curr < 0) {
+		dev_err(di->dev, "error reading current\n");
+		return curr;
+	}
+
+	curr = bq27x00_field_value(f, curr);
+
+	/* the bq27000 reports the magnitude, CHGS gives the sign */
+	if (di->desc->ai_charge_sign && !(di->cache.flags & BQ27x00_FLAG_DSG)) {
+		dev_dbg(di->dev, "negative current!\n");
+		curr = -curr;
+	}
+
+	bq27x00_last_set(di, BQ27x00_LAST_CURR, curr);
+	val->intval = curr;
+
+	return 0;
+}
+
+static int bq27x00_battery_status(struct bq27x00_device_info *di,
+	union power_supply_propval *val)
+{
+	int status;
+
+	if (di->cache.flags & BQ27x00_FLAG_FC)
+		status = POWER_SUPPLY_STATUS_FULL;
+	else if (di->cache.flags & BQ27x00_FLAG_DSG)
+		status = POWER_SUPPLY_STATUS_DISCHARGING;
+	else
+		status = POWER_SUPPLY_STATUS_CHARGING;
+
+	val->intval = status;
+
+	return 0;
+}
+
+static int bq27x00_battery_capacity_level(struct bq27x00_device_info *di,
+	union power_supply_propval *val)
+{
+	int level;
+
+	if (di->cache.flags & BQ27x00_FLAG_FC)
+		level = POWER_SUPPLY_CAPACITY_LEVEL_FULL;
+	else if (di->cache.flags & BQ27x00_FLAG_SOC1)
+		level = POWER_SUPPLY_CAPACITY_LEVEL_LOW;
+	else if (di->cache.flags & BQ27x00_FLAG_SOCF)
+		level = POWER_SUPPLY_CAPACITY_LEVEL_CRITICAL;
+	else
+		level = POWER_SUPPLY_CAPACITY_LEVEL_NORMAL;
+
+	val->intval = level;
+
+	return 0;
+}
+
+/*
+ * Return the battery Voltage in millivolts(Unit:mV/1000)
+ * Or < 0 if something fails.
+ */
+static int bq27x00_battery_voltage(struct bq27x00_device_info *di,
+	union power_supply_propval *val)
+{
+	int volt;
+
+	if (!bq27x00_bus_admit(di, BQ27x00_WORD_COST)) {
+		if (!bq27x00_last_get(di, BQ27x00_LAST_VOLT, &volt))
+			return -EAGAIN;
+		val->intval = volt;
+		return 0;
+	}
+
+	volt = bq27x00_read_field(di, &di->desc->volt);
+	if (volt < 0) {
+		dev_err(di->dev, "error reading voltage\n");
+		return volt;
+	}
+
+	bq27x00_last_set(di, BQ27x00_LAST_VOLT, volt);
+	val->intval = volt;
+
+	return 0;
+}
+
+static int bq27x00_simple_value(int value,
+	union power_supply_propval *val)
+{
+	if (value < 0)
+		return value;
+
+	val->intval = value;
+
+	return 0;
+}
+
+/*
+ * Bring the snapshot to at most max_age ms old, taking a new sample if
+ * it is older and the bus budget allows. A negative max_age accepts
+ * whatever is cached. The first sample is left to the poll work, until
+ * then readers get the "not ready" state.
+ */
+static void bq27x00_refresh(struct bq27x00_device_info *di, int max_age)
+{
+	const struct bq27x00_chip_desc *d = di->desc;
+
+	/* a replayed trace is only consumed by the poll work, in order */
+	if (max_age < 0 || !di->ready || di->suspended ||
+	    bq27x00_replaying(di))
+		return;
+
+	mutex_lock(&di->lock);
+	if (ktime_to_ms(ktime_sub(ktime_get(), di->stamp)) > max_age &&
+	    bq27x00_bus_admit(di, d->snap_len + d->cut_len + 2)) {
+		bq27x00_cancel_poll(di);
+		bq27x00_battery_poll(&di->work);
+	}
+	mutex_unlock(&di->lock);
+}
+
+/*
+ * Like bq27x00_refresh(), but only queue the sample on the poll work
+ * instead of waiting for it, for callers that must not block.
+ */
+static void bq27x00_refresh_kick(struct bq27x00_device_info *di, int max_age)
+{
+	const struct bq27x00_chip_desc *d = di->desc;
+	ktime_t stamp;
+
+	if (max_age < 0 || !di->ready || di->suspended ||
+	    bq27x00_replaying(di))
+		return;
+
+	mutex_lock(&di->update_lock);
+	stamp = di->stamp;
+	mutex_unlock(&di->update_lock);
+
+	if (ktime_to_ms(ktime_sub(ktime_get(), stamp)) > max_age &&
+	    bq27x00_bus_admit(di, d->snap_len + d->cut_len + 2))
+		bq27x00_schedule_poll(di, 0);
+}
+
+#define to_bq27x00_device_info(x) container_of((x), \
+				struct bq27x00_device_info, bat);
+
+static int bq27x00_battery_get_property(struct power_supply *psy,
+					enum power_supply_property psp,
+					union power_supply_propval *val)
+{
+	int ret = 0;
+	struct bq27x00_device_info *di = to_bq27x00_device_info(psy);
+
+	/* nothing sampled yet, don't block on the bus waiting for it */
+	if (!di->ready) {
+		if (psp == POWER_SUPPLY_PROP_STATUS) {
+			val->intval = POWER_SUPPLY_STATUS_UNKNOWN;
+			return 0;
+		}
+		if (psp == POWER_SUPPLY_PROP_TECHNOLOGY) {
+			val->intval = POWER_SUPPLY_TECHNOLOGY_LION;
+			return 0;
+		}
+		return -ENODATA;
+	}
+
+	bq27x00_refresh(di, di->max_age);
+
+	if (psp != POWER_SUPPLY_PROP_PRESENT && di->cache.flags < 0)
+		return -ENODEV;
+
+	switch (psp) {
+	case POWER_SUPPLY_PROP_STATUS:
+		ret = bq27x00_battery_status(di, val);
+		break;
+	case POWER_SUPPLY_PROP_VOLTAGE_NOW:
+		ret = bq27x00_battery_voltage(di, val);
+		break;
+	case POWER_SUPPLY_PROP_PRESENT:
+		val->intval = di->cache.flags < 0 ? 0 : 1;
+		break;
+	case POWER_SUPPLY_PROP_CURRENT_NOW:
+		ret = bq27x00_battery_current(di, val);
+		break;
+	case POWER_SUPPLY_PROP_CAPACITY:
+		ret = bq27x00_simple_value(di->cache.capacity, val);
+		break;
+	case POWER_SUPPLY_PROP_CAPACITY_LEVEL:
+		ret = bq27x00_battery_capacity_level(di, val);
+		break;
+	case POWER_SUPPLY_PROP_TEMP:
+		ret = bq27x00_simple_value(di->cache.temperature, val);
+		/* change the unit into tenths of degree Celsius(0.1C)*/
+		if (ret == 0)
+			val->intval -= 2731;
+		break;
+	case POWER_SUPPLY_PROP_TIME_TO_EMPTY_NOW:
+		ret = bq27x00_simple_value(di->cache.time_to_empty, val);
+		break;
+	case POWER_SUPPLY_PROP_TIME_TO_EMPTY_AVG:
+		ret = bq27x00_simple_value(di->cache.time_to_empty_avg, val);
+		break;
+	case POWER_SUPPLY_PROP_TIME_TO_FULL_NOW:
+		ret = bq27x00_simple_value(di->cache.time_to_full, val);
+		break;
+	case POWER_SUPPLY_PROP_TECHNOLOGY:
+		val->intval = POWER_SUPPLY_TECHNOLOGY_LION;
+		break;
+	case POWER_SUPPLY_PROP_CHARGE_NOW:
+		ret = bq27x00_simple_value(bq27x00_battery_read_nac(di), val);
+		break;
+	case POWER_SUPPLY_PROP_CHARGE_FULL:
+		ret = bq27x00_simple_value(di->cache.charge_full, val);
+		break;
+	case POWER_SUPPLY_PROP_CHARGE_FULL_DESIGN:
+		ret = bq27x00_simple_value(di->charge_design_full, val);
+		break;
+	case POWER_SUPPLY_PROP_CYCLE_COUNT:
+		ret = bq27x00_simple_value(di->cache.cycle_count, val);
+		break;
+	case POWER_SUPPLY_PROP_CHARGE_COUNTER:
+		/* signed, only listed for chips that have it */
+		val->intval = di->cache.passed_charge;
+		break;
+	case POWER_SUPPLY_PROP_CONSTANT_CHARGE_CURRENT:
+		ret = bq27x00_simple_value(di->cache.charge_current, val);
+		break;
+	case POWER_SUPPLY_PROP_CONSTANT_CHARGE_VOLTAGE:
+		ret = bq27x00_simple_value(di->cache.charge_voltage, val);
+		break;
+	case POWER_SUPPLY_PROP_ENERGY_NOW:
+		ret = bq27x00_simple_value(di->cache.energy, val);
+		break;
+	case POWER_SUPPLY_PROP_POWER_AVG:
+		/* signed, only -ENODATA means it is missing */
+		if (di->cache.power_avg == -ENODATA)
+			ret = -ENODATA;
+		else
+			val->intval = di->cache.power_avg;
+		break;
+	case POWER_SUPPLY_PROP_HEALTH:
+		ret = bq27x00_simple_value(di->cache.health, val);
+		break;
+	case POWER_SUPPLY_PROP_MANUFACTURER:
+		val->strval = di->ident.manufacturer;
+		break;
+	case POWER_SUPPLY_PROP_SERIAL_NUMBER:
+		val->strval = di->ident.serial_str;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return ret;
+}
+
+static void bq27x00_external_power_changed(struct power_supply *psy)
+{
+	struct bq27x00_device_info *di = to_bq27x00_device_info(psy);
+
+	/* probe starts the first poll itself */
+	if (!di->probed)
+		return;
+
+	bq27x00_cancel_poll(di);
+	bq27x00_schedule_poll(di, 0);
+}
+
+static int bq27x00_powersupply_init(struct bq27x00_device_info *di)
+{
+	int ret;
+
+	di->bat.type = POWER_SUPPLY_TYPE_BATTERY;
+	di->bat.properties = di->desc->props;
+	di->bat.num_properties = di->desc->num_props;
+	di->bat.get_property = bq27x00_battery_get_property;
+	di->bat.external_power_changed = bq27x00_external_power_changed;
+
+	init_kthread_work(&di->work, bq27x00_battery_poll);
+	setup_timer(&di->poll_timer, bq27x00_poll_timer, (unsigned long)di);
+	mutex_init(&di->lock);
+	mutex_init(&di->update_lock);
+
+	ret = power_supply_register(di->dev, &di->bat);
+	if (ret) {
+		dev_err(di->dev, "failed to register battery: %d\n", ret);
+		return ret;
+	}
+
+	dev_info(di->dev, "support ver. %s enabled\n", DRIVER_VERSION);
+
+	return 0;
+}
+
+static void bq27x00_powersupply_unregister(struct bq27x00_device_info *di)
+{
+	/*
+	 * power_supply_unregister call bq27x00_battery_get_property which
+	 * call bq27x00_battery_poll.
+	 * Make sure that bq27x00_battery_poll will not call
+	 * bq27x00_schedule_poll again after unregister (which cause OOPS).
+	 * The other gauges keep polling.
+	 */
+	di->probed = false;
+
+	bq27x00_cancel_poll(di);
+
+	power_supply_unregister(&di->bat);
+
+	mutex_destroy(&di->update_lock);
+	mutex_destroy(&di->lock);
+}
+
+
+/* If the system has several batteries we need a different name for each
+ * of them...
+ */
+static DEFINE_IDR(battery_id);
+static DEFINE_MUTEX(battery_mutex);
+
+static int bq27x00_read_i2c(struct bq27x00_device_info *di, u8 reg, bool single)
+{
+	struct i2c_client *client = to_i2c_client(di->dev);
+	s32 data = 0;
+
+	if (!client->adapter)
+		return -ENODEV;
+
+	if (single)
+		data = i2c_smbus_read_byte_data(client, reg);
+	else
+		data = i2c_smbus_read_word_data(client, reg);
+	
+	if (data < 0)
+		return -EIO;
+
+	return data;
+}
+
+static int bq27x00_write_i2c(struct bq27x00_device_info *di, u8 reg, u16 value, bool single)
+{
+        struct i2c_client *client = to_i2c_client(di->dev);
+        int ret;
+
+	if (!client->adapter)
+                return -ENODEV;
+
+        if (single)
+                ret = i2c_smbus_write_byte_data(client, reg, value);
+        else
+                ret = i2c_smbus_write_word_data(client, reg, value);
+
+        if (ret < 0)
+                return -EIO;
+
+	return 0;
+
+}
+
+static int bq27x00_read_i2c_bulk(struct bq27x00_device_info *di, u8 reg,
+		u8 *data, int len)
+{
+	struct i2c_client *client = to_i2c_client(di->dev);
+	struct i2c_msg msg[2];
+	int ret;
+
+	if (!client->adapter)
+		return -ENODEV;
+
+	msg[0].addr = client->addr;
+	msg[0].flags = 0;
+	msg[0].buf = &reg;
+	msg[0].len = sizeof(reg);
+	msg[1].addr = client->addr;
+	msg[1].flags = I2C_M_RD;
+	msg[1].buf = data;
+	msg[1].len = len;
+
+	ret = i2c_transfer(client->adapter, msg, ARRAY_SIZE(msg));
+	if (ret != ARRAY_SIZE(msg))
+		return -EIO;
+
+	return 0;
+}
+
+static int bq27x00_write_i2c_bulk(struct bq27x00_device_info *di, u8 reg,
+		const u8 *data, int len)
+{
+	struct i2c_client *client = to_i2c_client(di->dev);
+	u8 buf[BQ27x00_BULK_MAX + 1];
+	int ret;
+
+	if (!client->adapter)
+		return -ENODEV;
+
+	if (len > BQ27x00_BULK_MAX)
+		return -EINVAL;
+
+	buf[0] = reg;
+	memcpy(&buf[1], data, len);
+
+	ret = i2c_master_send(client, buf, len + 1);
+	if (ret != len + 1)
+		return -EIO;
+
+	return 0;
+}
+
+/*
+ * Command sequences
+ *
+ * Control() round trips, data flash block access, AtRate queries and
+ * flash programming take several transactions that must not interleave
+ * with each other. They run under seq_lock; nothing but the programmer
+ * itself may talk to a gauge in ROM mode.
+ */
+static int bq27x00_seq_begin(struct bq27x00_device_info *di)
+{
+	if (di->flash.active)
+		return -EBUSY;
+
+	mutex_lock(&di->seq_lock);
+	/* flashing may have started while we waited */
+	if (di->flash.active) {
+		mutex_unlock(&di->seq_lock);
+		return -EBUSY;
+	}
+
+	return 0;
+}
+
+static inline void bq27x00_seq_end(struct bq27x00_device_info *di)
+{
+	mutex_unlock(&di->seq_lock);
+}
+
+/*
+ * Issue a Control() subcommand and read its result back.
+ */
+static int bq27x00_control_read(struct bq27x00_device_info *di, u16 subcmd)
+{
+	int ret;
+
+	ret = bq27x00_seq_begin(di);
+	if (ret)
+		return ret;
+
+	ret = bq27x00_write(di, CONTROL_CMD, subcmd, false);
+	if (ret >= 0) {
+		msleep(10);
+		ret = bq27x00_read(di, CONTROL_CMD, false);
+	}
+
+	bq27x00_seq_end(di);
+
+	return ret;
+}
+
+/*
+ * Data flash access
+ *
+ * A subclass is transferred 32 bytes at a time: select it through
+ * BlockDataControl()/DataFlashClass()/DataFlashBlock(), then move the
+ * whole block through BlockData() in a single transfer. The gauge must
+ * be unsealed for any of this to work.
+ */
+
+static u8 bq27x00_df_checksum(const u8 *data)
+{
+	u8 sum = 0;
+	int i;
+
+	for (i = 0; i < BQ27x00_DF_BLOCK_SIZE; i++)
+		sum += data[i];
+
+	return 0xff - sum;
+}
+
+static int bq27x00_df_select(struct bq27x00_device_info *di, u8 subclass,
+		u8 block)
+{
+	int ret;
+
+	ret = bq27x00_write(di, BQ27x00_REG_DFDCNTL, 0, true);
+	if (ret < 0)
+		return ret;
+
+	ret = bq27x00_write(di, BQ27x00_REG_DFCLS, subclass, true);
+	if (ret < 0)
+		return ret;
+
+	return bq27x00_write(di, BQ27x00_REG_DFBLK, block, true);
+}
+
+/* Must be called between bq27x00_seq_begin() and bq27x00_seq_end(). */
+static int __bq27x00_df_read_block(struct bq27x00_device_info *di,
+		u8 subclass, u8 block, u8 *data)
+{
+	int retries = BQ27x00_DF_RETRIES;
+	int csum, ret;
+
+	do {
+		ret = bq27x00_df_select(di, subclass, block);
+		if (ret < 0)
+			continue;
+
+		ret = bq27x00_read_bulk(di, BQ27x00_REG_DFD, data,
+					BQ27x00_DF_BLOCK_SIZE);
+		if (ret < 0)
+			continue;
+
+		csum = bq27x00_read(di, BQ27x00_REG_DFDCKS, true);
+		if (csum < 0) {
+			ret = csum;
+			continue;
+		}
+
+		if (csum == bq27x00_df_checksum(data))
+			return 0;
+
+		dev_dbg(di->dev, "data flash %u/%u checksum mismatch\n",
+			subclass, block);
+		ret = -EIO;
+	} while (retries--);
+
+	dev_err(di->dev, "error reading data flash subclass %u block %u: %d\n",
+		subclass, block, ret);
+
+	return ret;
+}
+
+static int bq27x00_df_read_block(struct bq27x00_device_info *di, u8 subclass,
+		u8 block, u8 *data)
+{
+	int ret;
+
+	ret = bq27x00_seq_begin(di);
+	if (ret)
+		return ret;
+
+	ret = __bq27x00_df_read_block(di, subclass, block, data);
+	bq27x00_seq_end(di);
+
+	return ret;
+}
+
+static int bq27x00_df_write_block(struct bq27x00_device_info *di, u8 subclass,
+		u8 block, const u8 *data)
+{
+	u8 verify[BQ27x00_DF_BLOCK_SIZE];
+	int ret;
+
+	ret = bq27x00_seq_begin(di);
+	if (ret)
+		return ret;
+
+	ret = bq27x00_df_select(di, subclass, block);
+	if (ret < 0)
+		goto out;
+
+	ret = bq27x00_write_bulk(di, BQ27x00_REG_DFD, data,
+				 BQ27x00_DF_BLOCK_SIZE);
+	if (ret < 0)
+		goto out;
+
+	/* the gauge commits the block to flash when the checksum arrives */
+	ret = bq27x00_write(di, BQ27x00_REG_DFDCKS,
+			    bq27x00_df_checksum(data), true);
+	if (ret < 0)
+		goto out;
+
+	msleep(BQ27x00_DF_WRITE_DELAY);
+
+	ret = __bq27x00_df_read_block(di, subclass, block, verify);
+	if (ret < 0)
+		goto out;
+
+	if (memcmp(verify, data, BQ27x00_DF_BLOCK_SIZE)) {
+		dev_err(di->dev, "data flash subclass %u block %u verify failed\n",
+			subclass, block);
+		ret = -EIO;
+	}
+
+out:
+	bq27x00_seq_end(di);
+
+	return ret;
+}
+
+/*
+ * Make sure blocks [first, last] of the image are in the cache.
+ * Must be called with df_lock held.
+ */
+static int bq27x00_df_fill(struct bq27x00_df_image *img, int first, int last)
+{
+	int block, ret;
+
+	if (!img->data) {
+		img->data = kzalloc(img->desc->blocks * BQ27x00_DF_BLOCK_SIZE,
+				    GFP_KERNEL);
+		if (!img->data)
+			return -ENOMEM;
+	}
+
+	for (block = first; block <= last; block++) {
+		if (test_bit(block, &img->valid))
+			continue;
+
+		ret = bq27x00_df_read_block(img->di, img->desc->subclass, block,
+				img->data + block * BQ27x00_DF_BLOCK_SIZE);
+		if (ret < 0)
+			return ret;
+
+		set_bit(block, &img->valid);
+	}
+
+	return 0;
+}
+
+/*
+ * Write all dirty blocks of the image back in one go.
+ * Must be called with df_lock held.
+ */
+static int bq27x00_df_sync(struct bq27x00_df_image *img)
+{
+	int block, ret;
+
+	if (!img->dirty)
+		return 0;
+
+	/* a sealed gauge drops the writes without telling */
+	ret = bq27x00_control_read(img->di, CONTROL_STATUS_SUBCMD);
+	if (ret < 0)
+		return ret;
+	if (ret & BQ27x00_CS_SS) {
+		dev_err(img->di->dev, "data flash is sealed, unseal the gauge first\n");
+		return -EACCES;
+	}
+
+	for_each_set_bit(block, &img->dirty, img->desc->blocks) {
+		ret = bq27x00_df_write_block(img->di, img->desc->subclass, block,
+				img->data + block * BQ27x00_DF_BLOCK_SIZE);
+		if (ret < 0) {
+			/* force a re-read, the gauge content is unknown now */
+			clear_bit(block, &img->valid);
+			clear_bit(block, &img->dirty);
+			return ret;
+		}
+
+		clear_bit(block, &img->dirty);
+	}
+
+	return 0;
+}
+
+static void bq27x00_df_invalidate(struct bq27x00_device_info *di)
+{
+	int i;
+
+	mutex_lock(&di->df_lock);
+	for (i = 0; i < ARRAY_SIZE(di->df); i++)
+		di->df[i].valid = di->df[i].dirty;
+	mutex_unlock(&di->df_lock);
+}
+
+static int bq27x00_df_open(struct inode *inode, struct file *file)
+{
+	struct bq27x00_df_image *img = inode->i_private;
+
+	file->private_data = img;
+
+	if (img->desc->volatile_data) {
+		mutex_lock(&img->di->df_lock);
+		img->valid = img->dirty;
+		mutex_unlock(&img->di->df_lock);
+	}
+
+	return 0;
+}
+
+static ssize_t bq27x00_df_read(struct file *file, char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct bq27x00_df_image *img = file->private_data;
+	size_t size = img->desc->blocks * BQ27x00_DF_BLOCK_SIZE;
+	ssize_t ret;
+
+	if (*ppos >= size)
+		return 0;
+	count = min_t(size_t, count, size - *ppos);
+
+	mutex_lock(&img->di->df_lock);
+	ret = bq27x00_df_fill(img, *ppos / BQ27x00_DF_BLOCK_SIZE,
+			      (*ppos + count - 1) / BQ27x00_DF_BLOCK_SIZE);
+	if (ret == 0)
+		ret = simple_read_from_buffer(buf, count, ppos, img->data, size);
+	mutex_unlock(&img->di->df_lock);
+
+	return ret;
+}
+
+/*
+ * Writes only land in the cached image; the dirty blocks are flushed
+ * to the gauge together when the file is closed.
+ */
+static ssize_t bq27x00_df_write(struct file *file, const char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct bq27x00_df_image *img = file->private_data;
+	size_t size = img->desc->blocks * BQ27x00_DF_BLOCK_SIZE;
+	int first, last, block;
+	ssize_t ret;
+
+	if (*ppos >= size)
+		return -ENOSPC;
+	count = min_t(size_t, count, size - *ppos);
+
+	first = *ppos / BQ27x00_DF_BLOCK_SIZE;
+	last = (*ppos + count - 1) / BQ27x00_DF_BLOCK_SIZE;
+
+	mutex_lock(&img->di->df_lock);
+	/* partially written blocks need the rest of their content */
+	ret = bq27x00_df_fill(img, first, last);
+	if (ret == 0)
+		ret = simple_write_to_buffer(img->data, size, ppos, buf, count);
+	if (ret > 0)
+		for (block = first; block <= last; block++)
+			set_bit(block, &img->dirty);
+	mutex_unlock(&img->di->df_lock);
+
+	return ret;
+}
+
+static int bq27x00_df_flush(struct file *file, fl_owner_t id)
+{
+	struct bq27x00_df_image *img = file->private_data;
+	int ret;
+
+	if (!(file->f_mode & FMODE_WRITE))
+		return 0;
+
+	mutex_lock(&img->di->df_lock);
+	ret = bq27x00_df_sync(img);
+	mutex_unlock(&img->di->df_lock);
+
+	return ret;
+}
+
+static const struct file_operations bq27x00_df_fops = {
+	.owner = THIS_MODULE,
+	.open = bq27x00_df_open,
+	.read = bq27x00_df_read,
+	.write = bq27x00_df_write,
+	.flush = bq27x00_df_flush,
+	.llseek = default_llseek,
+};
+
+static void bq27x00_df_init(struct bq27x00_device_info *di)
+{
+	struct dentry *dir;
+	char name[32];
+	int i;
+
+	mutex_init(&di->df_lock);
+
+	for (i = 0; i < ARRAY_SIZE(di->df); i++) {
+		di->df[i].di = di;
+		di->df[i].desc = &bq34z100_df_subclasses[i];
+	}
+
+	if (!di->debugfs || !di->desc->dataflash)
+		return;
+
+	dir = debugfs_create_dir("dataflash", di->debugfs);
+	if (IS_ERR_OR_NULL(dir))
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(di->df); i++) {
+		snprintf(name, sizeof(name), "%03u-%s", di->df[i].desc->subclass,
+			 di->df[i].desc->name);
+		debugfs_create_file(name, S_IRUSR | S_IWUSR, dir, &di->df[i],
+				    &bq27x00_df_fops);
+	}
+}
+
+static void bq27x00_df_exit(struct bq27x00_device_info *di)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(di->df); i++)
+		kfree(di->df[i].data);
+
+	mutex_destroy(&di->df_lock);
+}
+
+static int bq27x00_battery_reset(struct bq27x00_device_info *di)
+{
+	if (!di->desc->control)
+		return -EOPNOTSUPP;
+
+	dev_info(di->dev, "Gas Gauge Reset\n");
+
+	if (bq27x00_seq_begin(di))
+		return -EBUSY;
+	if (bq27x00_write(di, BQ27x00_REG_CTRL, RESET_SUBCMD, false) < 0)
+		dev_err(di->dev, "Gas Gauge Reset error.\n");
+	bq27x00_seq_end(di);
+
+	bq27x00_df_invalidate(di);
+
+	msleep(10);
+
+	return 0;
+}
+
+
+static int bq27x00_battery_enable_it(struct bq27x00_device_info *di)
+{
+	if (!di->desc->control)
+		return -EOPNOTSUPP;
+
+	dev_info(di->dev, "Goint to enable IT.\n");
+
+	if (bq27x00_seq_begin(di))
+		return -EBUSY;
+	if (bq27x00_write(di, BQ27x00_REG_CTRL, ITENABLE_SUBCMD, false) < 0)
+		dev_err(di->dev, "IT enable error.\n");
+	bq27x00_seq_end(di);
+
+	msleep(10);
+
+         return 0;
+}
+
+static int bq27x00_battery_read_fw_version(struct bq27x00_device_info *di)
+{
+	return bq27x00_control_read(di, FW_VER_SUBCMD);
+}
+
+static int bq27x00_battery_read_device_type(struct bq27x00_device_info *di)
+{
+	return bq27x00_control_read(di, DEV_TYPE_SUBCMD);
+}
+
+static int bq27x00_battery_read_dataflash_version(struct bq27x00_device_info *di)
+{
+	return bq27x00_control_read(di, DF_VER_SUBCMD);
+}
+
+/* Copy a length-prefixed string out of the identity block */
+static void bq27x00_ident_str(char *dst, size_t size, const u8 *len,
+		const u8 *str)
+{
+	size_t n = min_t(size_t, *len, size - 1);
+
+	memcpy(dst, str, n);
+	dst[n] = '\0';
+	strim(dst);
+}
+
+/*
+ * Read everything that identifies the pack. Mfr date, name, chemistry
+ * and serial number are adjacent and come in with one block read; the
+ * versions need a Control() round trip each.
+ */
+static void bq27x00_read_identity(struct bq27x00_device_info *di)
+{
+	struct bq27x00_identity *ident = &di->ident;
+	u8 buf[BQ27x00_IDENT_LEN];
+	int ret;
+
+#define IDENT(reg)	(&buf[(reg) - BQ27x00_REG_DATE])
+
+	if (di->desc->control) {
+		ident->device_type = bq27x00_battery_read_device_type(di);
+		ident->fw_version = bq27x00_battery_read_fw_version(di);
+		ident->df_version =
+			bq27x00_battery_read_dataflash_version(di);
+	} else {
+		ident->device_type = -EOPNOTSUPP;
+		ident->fw_version = -EOPNOTSUPP;
+		ident->df_version = -EOPNOTSUPP;
+	}
+
+	ret = di->desc->ident ? bq27x00_read_bulk(di, BQ27x00_REG_DATE, buf,
+						  sizeof(buf)) : -EOPNOTSUPP;
+	if (ret < 0) {
+		if (ret != -EOPNOTSUPP)
+			dev_err(di->dev, "error reading identity: %d\n", ret);
+		ident->date = ret;
+		ident->serial = ret;
+		strcpy(ident->manufacturer, "Unknown");
+		strcpy(ident->chemistry, "Unknown");
+		strcpy(ident->serial_str, "Unknown");
+		return;
+	}
+
+	ident->date = get_unaligned_le16(IDENT(BQ27x00_REG_DATE));
+	ident->serial = get_unaligned_le16(IDENT(BQ27x00_REG_SERNUM));
+	bq27x00_ident_str(ident->manufacturer, sizeof(ident->manufacturer),
+			  IDENT(BQ27x00_REG_NAMEL), IDENT(BQ27x00_REG_NAME));
+	bq27x00_ident_str(ident->chemistry, sizeof(ident->chemistry),
+			  IDENT(BQ27x00_REG_CHEML), IDENT(BQ27x00_REG_CHEM));
+	snprintf(ident->serial_str, sizeof(ident->serial_str), "%04x",
+		 ident->serial);
+
+#undef IDENT
+}
+
+/*
+ * Flash stream programming
+ *
+ * TI's .bqfs (firmware + data flash) and .dffs (data flash only) images
+ * are text files with one command per line:
+ *
+ *	W: <addr> <reg> <data>...	write data starting at reg
+ *	R: <addr> <reg> <count>		read and discard count bytes
+ *	C: <addr> <reg> <data>...	read and compare against data
+ *	X: <ms>				wait
+ *	;				comment
+ *
+ * Addresses are 8-bit (0xAA normal mode, 0x16 ROM mode). The image is
+ * parsed line by line straight out of the firmware buffer. Consecutive
+ * writes to adjacent registers are merged into one I2C transfer.
+ */
+
+struct bq27x00_fs_cmd {
+	char type;
+	u8 addr;
+	u8 reg;
+	u8 data[BQ27x00_BULK_MAX];
+	int len;
+	unsigned int delay;
+};
+
+struct bq27x00_fs_ctx {
+	struct bq27x00_fs_cmd cmd;
+	struct bq27x00_fs_cmd pending;	/* write being merged */
+	u8 buf[BQ27x00_BULK_MAX];
+	bool rom;			/* gauge is in ROM mode */
+};
+
+static int bq27x00_fs_parse(const char *p, const char *end,
+		struct bq27x00_fs_cmd *cmd)
+{
+	u8 bytes[BQ27x00_BULK_MAX + 2];
+	int n = 0, hi, lo;
+
+	cmd->type = 0;
+
+	while (p < end && isspace(*p))
+		p++;
+	if (p == end || *p == ';')
+		return 0;
+
+	if (end - p < 2 || p[1] != ':')
+		return -EINVAL;
+	cmd->type = toupper(*p);
+	p += 2;
+
+	if (cmd->type == 'X') {
+		while (p < end && isspace(*p))
+			p++;
+		if (p == end || !isdigit(*p))
+			return -EINVAL;
+		for (cmd->delay = 0; p < end && isdigit(*p); p++)
+			cmd->delay = cmd->delay * 10 + *p - '0';
+		return 0;
+	}
+
+	while (p < end) {
+		while (p < end && isspace(*p))
+			p++;
+		if (p == end)
+			break;
+		if (end - p < 2 || n == ARRAY_SIZE(bytes))
+			return -EINVAL;
+		hi = hex_to_bin(p[0]);
+		lo = hex_to_bin(p[1]);
+		if (hi < 0 || lo < 0)
+			return -EINVAL;
+		bytes[n++] = hi << 4 | lo;
+		p += 2;
+	}
+
+	if (n < 3 || (cmd->type == 'R' && n != 3))
+		return -EINVAL;
+	if (cmd->type != 'W' && cmd->type != 'R' && cmd->type != 'C')
+		return -EINVAL;
+
+	cmd->addr = bytes[0] >> 1;
+	cmd->reg = bytes[1];
+	cmd->len = n - 2;
+	memcpy(cmd->data, &bytes[2], cmd->len);
+
+	if (cmd->type == 'R' && (!cmd->data[0] || cmd->data[0] > BQ27x00_BULK_MAX))
+		return -EINVAL;
+
+	return 0;
+}
+
+static int bq27x00_fs_write(struct bq27x00_device_info *di, u8 addr, u8 reg,
+		const u8 *data, int len)
+{
+	struct i2c_client *client = to_i2c_client(di->dev);
+	u8 buf[BQ27x00_BULK_MAX + 1];
+	struct i2c_msg msg = {
+		.addr = addr,
+		.flags = 0,
+		.buf = buf,
+		.len = len + 1,
+	};
+
+	buf[0] = reg;
+	memcpy(&buf[1], data, len);
+
+	return i2c_transfer(client->adapter, &msg, 1) == 1 ? 0 : -EIO;
+}
+
+static int bq27x00_fs_read(struct bq27x00_device_info *di, u8 addr, u8 reg,
+		u8 *data, int len)
+{
+	struct i2c_client *client = to_i2c_client(di->dev);
+	struct i2c_msg msg[2] = {
+		{ .addr = addr, .flags = 0, .buf = &reg, .len = 1 },
+		{ .addr = addr, .flags = I2C_M_RD, .buf = data, .len = len },
+	};
+
+	return i2c_transfer(client->adapter, msg, 2) == 2 ? 0 : -EIO;
+}
+
+/* Poll until the gauge answers at addr, instead of sleeping blindly. */
+static int bq27x00_fs_wait_addr(struct bq27x00_device_info *di, u8 addr)
+{
+	unsigned long timeout = jiffies + msecs_to_jiffies(BQ27x00_ROM_TIMEOUT);
+	u8 dummy;
+
+	do {
+		if (bq27x00_fs_read(di, addr, 0, &dummy, 1) == 0)
+			return 0;
+		msleep(20);
+	} while (time_before(jiffies, timeout));
+
+	return -ETIMEDOUT;
+}
+
+static int bq27x00_fs_enter_rom(struct bq27x00_device_info *di)
+{
+	int ret;
+
+	dev_info(di->dev, "entering ROM mode\n");
+
+	ret = bq27x00_write(di, BQ27x00_REG_CTRL, ROM_MODE_SUBCMD, false);
+	if (ret < 0)
+		return ret;
+
+	return bq27x00_fs_wait_addr(di, BQ27x00_ROM_ADDR);
+}
+
+static int bq27x00_fs_exit_rom(struct bq27x00_device_info *di)
+{
+	u8 cmd[] = { 0x0F, 0x00 };
+	int ret;
+
+	dev_info(di->dev, "leaving ROM mode\n");
+
+	ret = bq27x00_fs_write(di, BQ27x00_ROM_ADDR, 0x00, cmd, 1);
+	if (ret == 0)
+		ret = bq27x00_fs_write(di, BQ27x00_ROM_ADDR,
+				BQ27x00_ROM_EXIT_REG, cmd, sizeof(cmd));
+	if (ret < 0)
+		return ret;
+
+	return bq27x00_fs_wait_addr(di, to_i2c_client(di->dev)->addr);
+}
+
+static int bq27x00_fs_flush(struct bq27x00_device_info *di,
+		struct bq27x00_fs_cmd *w)
+{
+	int ret;
+
+	if (!w->len)
+		return 0;
+
+	ret = bq27x00_fs_write(di, w->addr, w->reg, w->data, w->len);
+	w->len = 0;
+
+	return ret;
+}
+
+static int bq27x00_fs_exec(struct bq27x00_device_info *di,
+		struct bq27x00_fs_ctx *ctx)
+{
+	struct bq27x00_fs_cmd *cmd = &ctx->cmd;
+	struct bq27x00_fs_cmd *w = &ctx->pending;
+	int ret;
+
+	if (!cmd->type)
+		return 0;
+
+	if (cmd->type == 'W' && w->len && w->addr == cmd->addr &&
+	    w->reg + w->len == cmd->reg &&
+	    w->len + cmd->len <= BQ27x00_BULK_MAX) {
+		memcpy(w->data + w->len, cmd->data, cmd->len);
+		w->len += cmd->len;
+		return 0;
+	}
+
+	ret = bq27x00_fs_flush(di, w);
+	if (ret < 0)
+		return ret;
+
+	/* images that expect the gauge to already be in ROM mode */
+	if (cmd->type != 'X' && cmd->addr == BQ27x00_ROM_ADDR && !ctx->rom) {
+		if (bq27x00_fs_wait_addr(di, BQ27x00_ROM_ADDR) < 0) {
+			ret = bq27x00_fs_enter_rom(di);
+			if (ret < 0)
+				return ret;
+		}
+		ctx->rom = true;
+	}
+
+	switch (cmd->type) {
+	case 'W':
+		*w = *cmd;
+		return 0;
+	case 'R':
+		return bq27x00_fs_read(di, cmd->addr, cmd->reg, ctx->buf,
+				       cmd->data[0]);
+	case 'C':
+		ret = bq27x00_fs_read(di, cmd->addr, cmd->reg, ctx->buf,
+				      cmd->len);
+		if (ret < 0)
+			return ret;
+		if (memcmp(ctx->buf, cmd->data, cmd->len)) {
+			dev_err(di->dev, "flash: line %u: compare failed at reg 0x%02x, "
+				"expected %*ph got %*ph\n", di->flash.line, cmd->reg,
+				cmd->len, cmd->data, cmd->len, ctx->buf);
+			return -EIO;
+		}
+		return 0;
+	case 'X':
+		msleep(cmd->delay);
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+static int bq27x00_fs_run(struct bq27x00_device_info *di,
+		const struct firmware *fw)
+{
+	const char *data = (const char *)fw->data;
+	const char *end = data + fw->size;
+	const char *p, *eol;
+	struct bq27x00_fs_ctx *ctx;
+	unsigned int pct, last_pct = 0;
+	int ret = 0;
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
+
+	for (p = data; p < end && ret == 0; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end;
+
+		di->flash.line++;
+		ret = bq27x00_fs_parse(p, eol, &ctx->cmd);
+		if (ret < 0) {
+			dev_err(di->dev, "flash: line %u: malformed command\n",
+				di->flash.line);
+			break;
+		}
+
+		ret = bq27x00_fs_exec(di, ctx);
+		di->flash.done = eol - data;
+
+		pct = di->flash.done * 100 / fw->size;
+		if (pct >= last_pct + 10) {
+			dev_info(di->dev, "flash: %u%% done\n", pct);
+			last_pct = pct;
+		}
+	}
+
+	if (ret == 0)
+		ret = bq27x00_fs_flush(di, &ctx->pending);
+	else
+		dev_err(di->dev, "flash: failed at line %u: %d\n",
+			di->flash.line, ret);
+
+	/* only leave ROM mode on success, a half written image needs it */
+	if (ret == 0 && ctx->rom &&
+	    bq27x00_fs_wait_addr(di, to_i2c_client(di->dev)->addr) < 0)
+		ret = bq27x00_fs_exit_rom(di);
+
+	kfree(ctx);
+
+	return ret;
+}
+
+static int bq27x00_flash_program(struct bq27x00_device_info *di,
+		const char *name)
+{
+	const struct firmware *fw;
+	int ret;
+
+	/* ROM mode is entered through Control() */
+	if (!di->desc->control)
+		return -EOPNOTSUPP;
+
+	if (!mutex_trylock(&di->flash.lock))
+		return -EBUSY;
+
+	ret = request_firmware(&fw, name, di->dev);
+	if (ret < 0) {
+		dev_err(di->dev, "flash: cannot load %s: %d\n", name, ret);
+		goto out;
+	}
+
+	mutex_lock(&di->lock);
+	di->flash.active = true;
+	di->flash.done = 0;
+	di->flash.size = fw->size;
+	di->flash.line = 0;
+	mutex_unlock(&di->lock);
+	bq27x00_cancel_poll(di);
+
+	dev_info(di->dev, "flash: programming %s (%zu bytes)\n", name,
+		 fw->size);
+
+	/* wait for sequences in flight, new ones see flash.active */
+	mutex_lock(&di->seq_lock);
+	bq27x00_bus_get(di);
+	ret = bq27x00_fs_run(di, fw);
+	bq27x00_bus_put(di);
+	mutex_unlock(&di->seq_lock);
+	if (ret == 0)
+		dev_info(di->dev, "flash: %s programmed\n", name);
+
+	release_firmware(fw);
+
+	bq27x00_df_invalidate(di);
+
+	mutex_lock(&di->lock);
+	di->flash.active = false;
+	mutex_unlock(&di->lock);
+
+	bq27x00_read_identity(di);
+	bq27x00_schedule_poll(di, 0);
+
+out:
+	di->flash.result = ret;
+	mutex_unlock(&di->flash.lock);
 
 	return ret;
 }
 
-static void bq27x00_external_power_changed(struct power_supply *psy)
+static ssize_t show_firmware_version(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
-	struct bq27x00_device_info *di = to_bq27x00_device_info(psy);
+	struct bq27x00_device_info *di = dev_get_drvdata(dev);
 
-	cancel_delayed_work_sync(&di->work);
-	schedule_delayed_work(&di->work, 0);
+	return sprintf(buf, "%d\n", di->ident.fw_version);
 }
 
-static int bq27x00_powersupply_init(struct bq27x00_device_info *di)
+static ssize_t show_dataflash_version(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
-	int ret;
+	struct bq27x00_device_info *di = dev_get_drvdata(dev);
 
-	di->bat.type = POWER_SUPPLY_TYPE_BATTERY;
-	di->bat.properties = bq27x00_battery_props;
-	di->bat.num_properties = ARRAY_SIZE(bq27x00_battery_props);
-	di->bat.get_property = bq27x00_battery_get_property;
-	di->bat.external_power_changed = bq27x00_external_power_changed;
+	return sprintf(buf, "%d\n", di->ident.df_version);
+}
 
-	INIT_DELAYED_WORK(&di->work, bq27x00_battery_poll);
-	mutex_init(&di->lock);
+static ssize_t show_device_type(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct bq27x00_device_info *di = dev_get_drvdata(dev);
 
-	ret = power_supply_register(di->dev, &di->bat);
-	if (ret) {
-		dev_err(di->dev, "failed to register battery: %d\n", ret);
-		return ret;
-	}
+	return sprintf(buf, "%d\n", di->ident.device_type);
+}
 
-	dev_info(di->dev, "support ver. %s enabled\n", DRIVER_VERSION);
+static ssize_t show_manufacturer(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct bq27x00_device_info *di = dev_get_drvdata(dev);
 
-	bq27x00_update(di);
+	return sprintf(buf, "%s\n", di->ident.manufacturer);
+}
 
-	return 0;
+static ssize_t show_chemistry(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct bq27x00_device_info *di = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%s\n", di->ident.chemistry);
 }
 
-static void bq27x00_powersupply_unregister(struct bq27x00_device_info *di)
+static ssize_t show_serial(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
-	/*
-	 * power_supply_unregister call bq27x00_battery_get_property which
-	 * call bq27x00_battery_poll.
-	 * Make sure that bq27x00_battery_poll will not call
-	 * schedule_delayed_work again after unregister (which cause OOPS).
-	 */
-	poll_interval = 0;
+	struct bq27x00_device_info *di = dev_get_drvdata(dev);
 
-	cancel_delayed_work_sync(&di->work);
+	return sprintf(buf, "%s\n", di->ident.serial_str);
+}
 
-	power_supply_unregister(&di->bat);
+/* Day + Month * 32 + (Year - 1980) * 512 */
+static ssize_t show_manufacture_date(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct bq27x00_device_info *di = dev_get_drvdata(dev);
+	int date = di->ident.date;
 
-	mutex_destroy(&di->lock);
+	if (date < 0)
+		return date;
+
+	return sprintf(buf, "%04d-%02d-%02d\n", 1980 + (date >> 9),
+		       (date >> 5) & 0x0f, date & 0x1f);
 }
 
+static ssize_t show_reset(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct bq27x00_device_info *di = dev_get_drvdata(dev);
+	int ret;
 
-/* If the system has several batteries we need a different name for each
- * of them...
- */
-#if 0
-static DEFINE_IDR(battery_id);
-static DEFINE_MUTEX(battery_mutex);
-#endif
+	ret = bq27x00_battery_reset(di);
+	if (ret < 0)
+		return ret;
 
-static int bq27x00_read_i2c(struct bq27x00_device_info *di, u8 reg, bool single)
+	return sprintf(buf, "okay\n");
+}
+
+
+static ssize_t show_it_enable(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
-	struct i2c_client *client = to_i2c_client(di->dev);
-	s32 data = 0;
+	struct bq27x00_device_info *di = dev_get_drvdata(dev);
+	int ret;
 
-	if (!client->adapter)
-		return -ENODEV;
+	ret = bq27x00_battery_enable_it(di);
+	if (ret < 0)
+		return ret;
 
-	if (single)
-		data = i2c_smbus_read_byte_data(client, reg);
-	else
-		data = i2c_smbus_read_word_data(client, reg);
-	
-	if (data < 0)
-		return -EIO;
+	return sprintf(buf, "it enabled\n");
+}
 
-	return data;
+static ssize_t show_flash(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct bq27x00_device_info *di = dev_get_drvdata(dev);
+
+	if (di->flash.active)
+		return sprintf(buf, "programming %zu/%zu line %u\n",
+			       di->flash.done, di->flash.size, di->flash.line);
+	if (di->flash.result > 0)
+		return sprintf(buf, "idle\n");
+	if (di->flash.result == 0)
+		return sprintf(buf, "ok\n");
+
+	return sprintf(buf, "error %d line %u\n", di->flash.result,
+		       di->flash.line);
 }
 
-static int bq27x00_write_i2c(struct bq27x00_device_info *di, u8 reg, u16 value, bool single)
+static ssize_t store_flash(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
 {
-        struct i2c_client *client = to_i2c_client(di->dev);
-        int ret;
+	struct bq27x00_device_info *di = dev_get_drvdata(dev);
+	char *name;
+	int ret;
 
-	if (!client->adapter)
-                return -ENODEV;
+	name = kstrndup(buf, count, GFP_KERNEL);
+	if (!name)
+		return -ENOMEM;
 
-        if (single)
-                ret = i2c_smbus_write_byte_data(client, reg, value);
-        else
-                ret = i2c_smbus_write_word_data(client, reg, value);
+	ret = bq27x00_flash_program(di, strim(name));
+	kfree(name);
 
-        if (ret < 0)
-                return -EIO;
+	return ret < 0 ? ret : count;
+}
 
-	return 0;
+static ssize_t show_bus_budget_xfers(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct bq27x00_device_info *di = dev_get_drvdata(dev);
 
+	return sprintf(buf, "%u\n", di->budget.xfers);
 }
 
-static int bq27x00_battery_reset(struct bq27x00_device_info *di)
+static ssize_t show_bus_budget_bytes(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
+	struct bq27x00_device_info *di = dev_get_drvdata(dev);
 
-         dev_info(di->dev, "Gas Gauge Reset\n");
- 
-         if(bq27x00_write(di, BQ27x00_REG_CTRL, RESET_SUBCMD, false) < 0)
-		dev_err(di->dev, "Gas Gauge Reset error.\n");
- 
-         msleep(10);
- 
-         return 0;
+	return sprintf(buf, "%u\n", di->budget.bytes);
 }
 
+/* largest budget accepted, keeps the token arithmetic in a long */
+#define BQ27x00_BUDGET_MAX	1000000
 
-static int bq27x00_battery_enable_it(struct bq27x00_device_info *di)
+static int bq27x00_parse_budget(const char *buf, unsigned int *val)
 {
+	int ret;
 
-         dev_info(di->dev, "Goint to enable IT.\n");
- 
-         if(bq27x00_write(di, BQ27x00_REG_CTRL, ITENABLE_SUBCMD, false) < 0)
-		dev_err(di->dev, "IT enable error.\n");
- 
-         msleep(10);
- 
-         return 0;
+	ret = kstrtouint(buf, 0, val);
+	if (ret)
+		return ret;
+
+	return *val > BQ27x00_BUDGET_MAX ? -EINVAL : 0;
 }
 
-static int bq27x00_battery_read_fw_version(struct bq27x00_device_info *di)
+static ssize_t store_bus_budget_xfers(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
 {
-	bq27x00_write_i2c(di, CONTROL_CMD, FW_VER_SUBCMD, false);
+	struct bq27x00_device_info *di = dev_get_drvdata(dev);
+	unsigned int val;
+	int ret;
 
-	msleep(10);
+	ret = bq27x00_parse_budget(buf, &val);
+	if (ret)
+		return ret;
+
+	bq27x00_budget_set(di, val, di->budget.bytes);
 
-	return bq27x00_read_i2c(di, CONTROL_CMD, false);
+	return count;
 }
 
-static int bq27x00_battery_read_device_type(struct bq27x00_device_info *di)
+static ssize_t store_bus_budget_bytes(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
 {
-	bq27x00_write_i2c(di, CONTROL_CMD, DEV_TYPE_SUBCMD, false);
+	struct bq27x00_device_info *di = dev_get_drvdata(dev);
+	unsigned int val;
+	int ret;
 
-	msleep(10);
+	ret = bq27x00_parse_budget(buf, &val);
+	if (ret)
+		return ret;
 
-	return bq27x00_read_i2c(di, CONTROL_CMD, false);
+	bq27x00_budget_set(di, di->budget.xfers, val);
+
+	return count;
 }
 
-static int bq27x00_battery_read_dataflash_version(struct bq27x00_device_info *di)
+static ssize_t show_bus_budget_deferred(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
-	bq27x00_write_i2c(di, CONTROL_CMD, DF_VER_SUBCMD, false);
-
-	msleep(10);
+	struct bq27x00_device_info *di = dev_get_drvdata(dev);
 
-	return bq27x00_read_i2c(di, CONTROL_CMD, false);
+	return sprintf(buf, "%lu\n", di->budget.deferred);
 }
 
-static ssize_t show_firmware_version(struct device *dev,
+static ssize_t show_snapshot_timestamp(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
 	struct bq27x00_device_info *di = dev_get_drvdata(dev);
-	int ver;
 
-	ver = bq27x00_battery_read_fw_version(di);
+	return sprintf(buf, "%lld\n", ktime_to_ns(di->stamp));
+}
+
+static ssize_t show_snapshot_seq(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct bq27x00_device_info *di = dev_get_drvdata(dev);
 
-	return sprintf(buf, "%d\n", ver);
+	return sprintf(buf, "%u\n", di->seq);
 }
 
-static ssize_t show_dataflash_version(struct device *dev,
+static ssize_t show_max_age(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
 	struct bq27x00_device_info *di = dev_get_drvdata(dev);
-	int ver;
 
-	ver = bq27x00_battery_read_dataflash_version(di);
+	return sprintf(buf, "%d\n", di->max_age);
+}
+
+static ssize_t store_max_age(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct bq27x00_device_info *di = dev_get_drvdata(dev);
+	int val, ret;
+
+	ret = kstrtoint(buf, 0, &val);
+	if (ret)
+		return ret;
 
-	return sprintf(buf, "%d\n", ver);
+	di->max_age = val < 0 ? -1 : val;
+
+	return count;
 }
 
-static ssize_t show_device_type(struct device *dev,
+/*
+ * Writing a rate in mA to at_rate, negative for a discharge, asks the
+ * gauge for the time to empty at it. Reading gives that time in
+ * seconds for the last rate written once the gauge has answered, about
+ * a second later; until then it fails with -EAGAIN.
+ */
+static ssize_t show_at_rate(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
 	struct bq27x00_device_info *di = dev_get_drvdata(dev);
-	int dev_type;
+	int rate = di->at_rate.rate;
+	int ret;
 
-	dev_type = bq27x00_battery_read_device_type(di);
+	ret = bq27x00_at_rate(di, &rate, false);
+	if (ret < 0)
+		return ret;
 
-	return sprintf(buf, "%d\n", dev_type);
+	return sprintf(buf, "%d\n", ret);
 }
 
-static ssize_t show_reset(struct device *dev,
-		struct device_attribute *attr, char *buf)
+static ssize_t store_at_rate(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
 {
 	struct bq27x00_device_info *di = dev_get_drvdata(dev);
+	int val, ret;
 
-	bq27x00_battery_reset(di);
+	ret = kstrtoint(buf, 0, &val);
+	if (ret)
+		return ret;
 
-	return sprintf(buf, "okay\n");
+	di->at_rate.rate = val;
+	ret = bq27x00_at_rate(di, &val, true);
+	if (ret < 0 && ret != -ENODATA && ret != -EINPROGRESS)
+		return ret;
+
+	return count;
+}
+
+/*
+ * poll_priority and poll_cpu retune the thread running the poll work.
+ * With poll_shared that thread serves all gauges.
+ */
+static ssize_t show_poll_priority(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct bq27x00_device_info *di = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", di->worker->priority);
 }
 
+static ssize_t store_poll_priority(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct bq27x00_device_info *di = dev_get_drvdata(dev);
+	int val, ret;
 
-static ssize_t show_it_enable(struct device *dev,
+	ret = kstrtoint(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	ret = bq27x00_worker_tune(di->worker, val, di->worker->cpu);
+
+	return ret ? ret : count;
+}
+
+static ssize_t show_poll_cpu(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
 	struct bq27x00_device_info *di = dev_get_drvdata(dev);
 
-	bq27x00_battery_enable_it(di);
+	return sprintf(buf, "%d\n", di->worker->cpu);
+}
 
-	return sprintf(buf, "it enabled\n");
+static ssize_t store_poll_cpu(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct bq27x00_device_info *di = dev_get_drvdata(dev);
+	int val, ret;
+
+	ret = kstrtoint(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	ret = bq27x00_worker_tune(di->worker, di->worker->priority,
+				  val < 0 ? -1 : val);
+
+	return ret ? ret : count;
 }
 
 static DEVICE_ATTR(fw_version, S_IRUGO, show_firmware_version, NULL);
@@ -842,6 +5054,25 @@ static DEVICE_ATTR(df_version, S_IRUGO, show_dataflash_version, NULL);
 static DEVICE_ATTR(device_type, S_IRUGO, show_device_type, NULL);
 static DEVICE_ATTR(reset, S_IRUGO, show_reset, NULL);
 static DEVICE_ATTR(it_enable, S_IRUGO, show_it_enable, NULL);
+static DEVICE_ATTR(manufacturer, S_IRUGO, show_manufacturer, NULL);
+static DEVICE_ATTR(chemistry, S_IRUGO, show_chemistry, NULL);
+static DEVICE_ATTR(serial, S_IRUGO, show_serial, NULL);
+static DEVICE_ATTR(manufacture_date, S_IRUGO, show_manufacture_date, NULL);
+static DEVICE_ATTR(flash, S_IRUGO | S_IWUSR, show_flash, store_flash);
+static DEVICE_ATTR(poll_priority, S_IRUGO | S_IWUSR, show_poll_priority,
+		   store_poll_priority);
+static DEVICE_ATTR(poll_cpu, S_IRUGO | S_IWUSR, show_poll_cpu,
+		   store_poll_cpu);
+static DEVICE_ATTR(at_rate, S_IRUGO | S_IWUSR, show_at_rate, store_at_rate);
+static DEVICE_ATTR(snapshot_timestamp, S_IRUGO, show_snapshot_timestamp, NULL);
+static DEVICE_ATTR(snapshot_seq, S_IRUGO, show_snapshot_seq, NULL);
+static DEVICE_ATTR(max_age, S_IRUGO | S_IWUSR, show_max_age, store_max_age);
+static DEVICE_ATTR(bus_budget_xfers, S_IRUGO | S_IWUSR,
+		   show_bus_budget_xfers, store_bus_budget_xfers);
+static DEVICE_ATTR(bus_budget_bytes, S_IRUGO | S_IWUSR,
+		   show_bus_budget_bytes, store_bus_budget_bytes);
+static DEVICE_ATTR(bus_budget_deferred, S_IRUGO, show_bus_budget_deferred,
+		   NULL);
 
 static struct attribute *bq27x00_attributes[] = {
 	&dev_attr_fw_version.attr,
@@ -849,6 +5080,20 @@ static struct attribute *bq27x00_attributes[] = {
 	&dev_attr_device_type.attr,
 	&dev_attr_reset.attr,
 	&dev_attr_it_enable.attr,
+	&dev_attr_manufacturer.attr,
+	&dev_attr_chemistry.attr,
+	&dev_attr_serial.attr,
+	&dev_attr_manufacture_date.attr,
+	&dev_attr_flash.attr,
+	&dev_attr_bus_budget_xfers.attr,
+	&dev_attr_bus_budget_bytes.attr,
+	&dev_attr_bus_budget_deferred.attr,
+	&dev_attr_snapshot_timestamp.attr,
+	&dev_attr_snapshot_seq.attr,
+	&dev_attr_max_age.attr,
+	&dev_attr_poll_priority.attr,
+	&dev_attr_poll_cpu.attr,
+	&dev_attr_at_rate.attr,
 	NULL
 };
 
@@ -856,6 +5101,113 @@ static const struct attribute_group bq27x00_attr_group = {
 	.attrs = bq27x00_attributes,
 };
 
+/*
+ * Extended metrics without a power supply property, in a "metrics"
+ * group. All of them come out of the regular snapshot.
+ */
+struct bq27x00_metric_attr {
+	struct device_attribute attr;
+	size_t offset;		/* in struct bq27x00_reg_cache */
+	bool is_signed;
+};
+
+static ssize_t show_metric(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct bq27x00_device_info *di = dev_get_drvdata(dev);
+	struct bq27x00_metric_attr *m =
+		container_of(attr, struct bq27x00_metric_attr, attr);
+	int value = *(int *)((u8 *)&di->cache + m->offset);
+
+	if (!di->ready || di->cache.flags < 0)
+		return -ENODATA;
+	if (value < 0 && !m->is_signed)
+		return value;
+
+	return sprintf(buf, "%d\n", value);
+}
+
+#define BQ27x00_METRIC(_name, _member, _signed)				\
+	static struct bq27x00_metric_attr bq27x00_metric_##_name = {	\
+		.attr = __ATTR(_name, S_IRUGO, show_metric, NULL),	\
+		.offset = offsetof(struct bq27x00_reg_cache, _member),	\
+		.is_signed = _signed,					\
+	}
+
+BQ27x00_METRIC(state_of_health, state_of_health, false);
+BQ27x00_METRIC(internal_temp, internal_temp, false);
+BQ27x00_METRIC(max_load_current, max_load_current, true);
+BQ27x00_METRIC(max_load_time_to_empty, max_load_tte, false);
+BQ27x00_METRIC(standby_current, standby_current, true);
+BQ27x00_METRIC(standby_time_to_empty, standby_tte, false);
+BQ27x00_METRIC(remaining_capacity, remaining_capacity, false);
+
+static struct attribute *bq27x00_metric_attributes[] = {
+	&bq27x00_metric_state_of_health.attr.attr,
+	&bq27x00_metric_internal_temp.attr.attr,
+	&bq27x00_metric_max_load_current.attr.attr,
+	&bq27x00_metric_max_load_time_to_empty.attr.attr,
+	&bq27x00_metric_standby_current.attr.attr,
+	&bq27x00_metric_standby_time_to_empty.attr.attr,
+	&bq27x00_metric_remaining_capacity.attr.attr,
+	NULL
+};
+
+static const struct attribute_group bq27x00_metric_group = {
+	.name = "metrics",
+	.attrs = bq27x00_metric_attributes,
+};
+
+/* the whole cache in one read, as a struct bq27x00_snapshot record */
+static ssize_t bq27x00_snapshot_read(struct file *filp, struct kobject *kobj,
+		struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+	struct bq27x00_device_info *di =
+		dev_get_drvdata(container_of(kobj, struct device, kobj));
+	const struct bq27x00_reg_cache *c;
+	struct bq27x00_sample s;
+	struct bq27x00_snapshot snap;
+
+	bq27x00_get_sample(di, &s);
+	c = &s.cache;
+	snap = (struct bq27x00_snapshot) {
+		.version = BQ27x00_SNAPSHOT_VERSION,
+		.size = sizeof(snap),
+		.timestamp = ktime_to_ns(s.stamp),
+		.seq = s.seq,
+		.temperature = c->temperature,
+		.time_to_empty = c->time_to_empty,
+		.time_to_empty_avg = c->time_to_empty_avg,
+		.time_to_full = c->time_to_full,
+		.charge_full = c->charge_full,
+		.cycle_count = c->cycle_count,
+		.capacity = c->capacity,
+		.energy = c->energy,
+		.flags = c->flags,
+		.power_avg = c->power_avg,
+		.health = c->health,
+		.flush_budget = c->flush_budget,
+		.state_of_health = c->state_of_health,
+		.internal_temp = c->internal_temp,
+		.charge_voltage = c->charge_voltage,
+		.charge_current = c->charge_current,
+		.max_load_current = c->max_load_current,
+		.max_load_tte = c->max_load_tte,
+		.standby_current = c->standby_current,
+		.standby_tte = c->standby_tte,
+		.passed_charge = c->passed_charge,
+		.remaining_capacity = c->remaining_capacity,
+	};
+
+	return memory_read_from_buffer(buf, count, &off, &snap, sizeof(snap));
+}
+
+static struct bin_attribute bq27x00_snapshot_attr = {
+	.attr = { .name = "snapshot", .mode = S_IRUGO },
+	.size = sizeof(struct bq27x00_snapshot),
+	.read = bq27x00_snapshot_read,
+};
+
 static int bq27x00_battery_probe(struct i2c_client *client,
 				 const struct i2c_device_id *id)
 {
@@ -864,14 +5216,10 @@ static int bq27x00_battery_probe(struct i2c_client *client,
 	int num;
 	int retval = 0;
 
-#if 0
 	/* Get new ID for the new battery device */
 	mutex_lock(&battery_mutex);
 	num = idr_alloc(&battery_id, client, 0, 0, GFP_KERNEL);
 	mutex_unlock(&battery_mutex);
-#else
-	num=0;
-#endif
 
 	if (num < 0)
 		return num;
@@ -893,15 +5241,49 @@ static int bq27x00_battery_probe(struct i2c_client *client,
 	di->id = num;
 	di->dev = &client->dev;
 	di->chip = id->driver_data;
+	di->desc = &bq27x00_chips[di->chip];
 	di->bat.name = name;
 	di->bus.read = &bq27x00_read_i2c;
 	di->bus.write = &bq27x00_write_i2c;
+	di->bus.read_bulk = &bq27x00_read_i2c_bulk;
+	di->bus.write_bulk = &bq27x00_write_i2c_bulk;
+	di->base = di->bus;
+	mutex_init(&di->flash.lock);
+	di->flash.result = 1;
+	mutex_init(&di->seq_lock);
+	init_rwsem(&di->in_use);
+	mutex_init(&di->at_rate.lock);
+	INIT_WORK(&di->at_rate.work, bq27x00_at_rate_work);
+	spin_lock_init(&di->budget.lock);
+	spin_lock_init(&di->last.lock);
+	di->max_age = max_age;
+
+	if (bq27x00_shared_worker) {
+		di->worker = bq27x00_shared_worker;
+	} else {
+		di->worker = bq27x00_worker_create(name);
+		if (IS_ERR(di->worker)) {
+			retval = PTR_ERR(di->worker);
+			dev_err(&client->dev, "failed to start poll thread: %d\n",
+				retval);
+			kfree(di);
+			goto batt_failed_2;
+		}
+	}
+
+	/* the PM callbacks and the poll work both need the drvdata */
+	i2c_set_clientdata(client, di);
+
+	pm_runtime_set_active(&client->dev);
+	pm_runtime_set_autosuspend_delay(&client->dev, autosuspend_delay);
+	pm_runtime_use_autosuspend(&client->dev);
+	pm_runtime_enable(&client->dev);
+
+	bq27x00_iio_init(di);
 
 	retval = bq27x00_powersupply_init(di);
 	if (retval)
 		goto batt_failed_3;
-
-	i2c_set_clientdata(client, di);
 /*
 	bq27x00_battery_reset(di);
 	msleep(10);
@@ -909,29 +5291,56 @@ static int bq27x00_battery_probe(struct i2c_client *client,
 	msleep(10);
 */	
 
-	dev_info(&client->dev,
-			"Gas Guage fw version 0x%04x; df version 0x%04x\n",
-			bq27x00_battery_read_fw_version(di), bq27x00_battery_read_dataflash_version(di));
+	if (bq27x00_debugfs_root) {
+		di->debugfs = debugfs_create_dir(name, bq27x00_debugfs_root);
+		if (IS_ERR_OR_NULL(di->debugfs))
+			di->debugfs = NULL;
+	}
+	bq27x00_df_init(di);
+	bq27x00_trace_init(di);
+	bq27x00_fault_init(di);
+	if (di->debugfs) {
+		debugfs_create_u32("cut_retries", S_IRUSR, di->debugfs,
+				   &di->cut_retries);
+		debugfs_create_u32("cut_torn", S_IRUSR, di->debugfs,
+				   &di->cut_torn);
+	}
 
 	retval = sysfs_create_group(&client->dev.kobj, &bq27x00_attr_group);
+	if (!retval && di->desc->metrics)
+		retval = sysfs_create_group(&client->dev.kobj,
+					    &bq27x00_metric_group);
+	if (!retval)
+		retval = sysfs_create_bin_file(&client->dev.kobj,
+					       &bq27x00_snapshot_attr);
 	if (retval)
 		dev_err(&client->dev, "could not create sysfs files\n");
 
+	mutex_lock(&bq27x00_list_lock);
+	list_add_tail(&di->node, &bq27x00_devices);
+	mutex_unlock(&bq27x00_list_lock);
 
+	/* everything the poll work touches is set up by now */
+	di->probed = true;
+	bq27x00_schedule_poll(di, 0);
 
 	return 0;
 
 batt_failed_3:
+	bq27x00_iio_exit(di);
+	pm_runtime_disable(&client->dev);
+	pm_runtime_dont_use_autosuspend(&client->dev);
+	pm_runtime_set_suspended(&client->dev);
+	if (di->worker != bq27x00_shared_worker)
+		bq27x00_worker_destroy(di->worker);
 	kfree(di);
 batt_failed_2:
 	kfree(name);
 batt_failed_1:
 
-#if 0
 	mutex_lock(&battery_mutex);
 	idr_remove(&battery_id, num);
 	mutex_unlock(&battery_mutex);
-#endif
 
 	return retval;
 }
@@ -940,15 +5349,47 @@ static int bq27x00_battery_remove(struct i2c_client *client)
 {
 	struct bq27x00_device_info *di = i2c_get_clientdata(client);
 
-	bq27x00_powersupply_unregister(di);
+	mutex_lock(&bq27x00_list_lock);
+	list_del(&di->node);
+	mutex_unlock(&bq27x00_list_lock);
+
+	/* wait for /proc/bbu and netlink walks that found the gauge listed */
+	down_write(&di->in_use);
+	up_write(&di->in_use);
+
+	sysfs_remove_bin_file(&client->dev.kobj, &bq27x00_snapshot_attr);
+	if (di->desc->metrics)
+		sysfs_remove_group(&client->dev.kobj, &bq27x00_metric_group);
+	sysfs_remove_group(&client->dev.kobj, &bq27x00_attr_group);
+
+	/* nobody can queue AtRate queries any more */
+	flush_work(&di->at_rate.work);
+
+	bq27x00_powersupply_unregister(di);
+	bq27x00_iio_exit(di);
+	bq27x00_pack_leave(di);
+	if (di->worker != bq27x00_shared_worker)
+		bq27x00_worker_destroy(di->worker);
+
+	pm_runtime_disable(&client->dev);
+	pm_runtime_dont_use_autosuspend(&client->dev);
+	pm_runtime_set_suspended(&client->dev);
+
+	debugfs_remove_recursive(di->debugfs);
+	bq27x00_df_exit(di);
+	bq27x00_trace_exit(di);
+	mutex_destroy(&di->flash.lock);
+	mutex_destroy(&di->seq_lock);
+	mutex_destroy(&di->at_rate.lock);
+
+	/* off the list and not polled any more, nobody can see it */
+	kfree(rcu_dereference_protected(di->render, true));
 
 	kfree(di->bat.name);
 
-#if 0
 	mutex_lock(&battery_mutex);
 	idr_remove(&battery_id, di->id);
 	mutex_unlock(&battery_mutex);
-#endif
 
 	kfree(di);
 
@@ -969,32 +5410,32 @@ static const char *status_str[] = {
 	"AC"
 };
 
-static int
-bbu_read_proc(char *buffer, char **start, off_t offset, int size, int *eof,
-                void *data)
+/* Format the /proc/bbu block of one gauge into at most size bytes. */
+static int bbu_format_proc(struct bq27x00_device_info *di, char *buffer,
+		size_t size)
 {
-        int len = 0; /* Don't include the null byte. */
-	char *p = buffer;
+	const struct bq27x00_reg_cache *cache = &di->cache;
+	int len;
 	int health = 0,status = 0;
 
 /*bq34z100 is powered by battery,so when battery is absent,the communication with bq34z100
- * will be error and cache.flags will be set a negative value in bq27x00_read_i2c fuction. */
-	if (cache.flags >= 0) {
-		if (cache.flags & BQ27x00_FLAG_SOCF)
+ * will be error and cache->flags will be set a negative value in bq27x00_read_i2c fuction. */
+	if (cache->flags >= 0) {
+		if (cache->flags & BQ27x00_FLAG_SOCF)
 		//	health = POWER_SUPPLY_HEALTH_DEAD;
 			health = 0;
-		else if (cache.flags & (BQ27x00_FLAG_OTC | BQ27x00_FLAG_OTD))
+		else if (cache->flags & (BQ27x00_FLAG_OTC | BQ27x00_FLAG_OTD))
 		//	health = POWER_SUPPLY_HEALTH_OVERHEAT;
 			health = 1;
 		else
 		//	health = POWER_SUPPLY_HEALTH_GOOD;
 			health = 2;
 
-		if (cache.flags & BQ27x00_FLAG_FC)
+		if (cache->flags & BQ27x00_FLAG_FC)
 		//	status = POWER_SUPPLY_STATUS_FULL;
 		//	status = 0;
 			status = 5;
-		else if (cache.flags & BQ27x00_FLAG_DSG)
+		else if (cache->flags & BQ27x00_FLAG_DSG)
 		//	status = POWER_SUPPLY_STATUS_DISCHARGING;
 		//	status = 0;
 			status = 4;
@@ -1006,48 +5447,532 @@ bbu_read_proc(char *buffer, char **start, off_t offset, int size, int *eof,
 	else
 		status = 3;
 
-    	p += sprintf(p,
-                     "Manufacturer:\t Kedacom\n"
-                     "SN:\t\t 2593SMP001\n"
+	len = scnprintf(buffer, size,
+                     "Manufacturer:\t %s\n"
+                     "SN:\t\t %s\n"
                      "Technology:\t Li-ion\n"
                      "Health:\t\t %s\n"
                      "Temperature:\t %d.%d\n"
-                     "Level:\t\t %d\%\n"
+                     "Level:\t\t %d%%\n"
                      "TimeRemaining:\t %ds\n"
-		     "Status:\t\t %s\n"
-                     "DataToFlush:\t 100M\n",
+		     "Status:\t\t %s\n",
+		      di->ident.manufacturer,
+		      di->ident.serial_str,
 		      health_str[health],
-		      (cache.temperature-2731)/10,
-		      (cache.temperature-2731)%10,
-		      cache.capacity,
-		      cache.time_to_empty,
+		      (cache->temperature-2731)/10,
+		      (cache->temperature-2731)%10,
+		      cache->capacity,
+		      cache->time_to_empty,
 		      status_str[status]);
 
-        len = p - buffer;
+	/* keep the historical value until the flush budget is configured */
+	if (cache->flush_budget >= 0)
+		len += scnprintf(buffer + len, size - len, "DataToFlush:\t %dM\n",
+				 cache->flush_budget);
+	else
+		len += scnprintf(buffer + len, size - len,
+				 "DataToFlush:\t 100M\n");
+
+	len += scnprintf(buffer + len, size - len, "Timestamp:\t %lld\n"
+			 "Sequence:\t %u\n",
+			 ktime_to_ns(di->stamp), di->seq);
+
+	return len;
+}
+
+/* longest block bbu_format_proc() writes for one gauge */
+#define BBU_PROC_BLOCK_MAX	512
+
+/*
+ * OpenMetrics exposition, read from /proc/bbu_metrics. Every gauge
+ * renders its samples of each metric family, a read puts them under the
+ * HELP and TYPE lines of the family.
+ */
+enum bq27x00_om_metric {
+	BQ27x00_OM_UP,
+	BQ27x00_OM_INFO,
+	BQ27x00_OM_SOC,
+	BQ27x00_OM_VOLTAGE,
+	BQ27x00_OM_CURRENT,
+	BQ27x00_OM_POWER,
+	BQ27x00_OM_TEMP,
+	BQ27x00_OM_TTE,
+	BQ27x00_OM_TTF,
+	BQ27x00_OM_CHARGE_FULL,
+	BQ27x00_OM_ENERGY,
+	BQ27x00_OM_CYCLES,
+	BQ27x00_OM_ON_BATTERY,
+	BQ27x00_OM_FLUSH,
+	BQ27x00_OM_SNAPSHOTS,
+	BQ27x00_OM_NR,
+};
+
+struct bq27x00_om_family {
+	const char *head;	/* TYPE and HELP lines */
+	const char *sample;	/* name of the samples */
+	int decimals;		/* the value is scaled by 10^decimals */
+};
+
+#define BQ27x00_OM(_name, _type, _sample, _decimals, _help) {		\
+	.head = "# TYPE " _name " " _type "\n# HELP " _name " " _help "\n",\
+	.sample = _sample,						\
+	.decimals = _decimals,						\
+}
+#define BQ27x00_OM_GAUGE(_name, _decimals, _help) \
+	BQ27x00_OM(_name, "gauge", _name, _decimals, _help)
+
+static const struct bq27x00_om_family bq27x00_om[BQ27x00_OM_NR] = {
+	[BQ27x00_OM_UP] = BQ27x00_OM_GAUGE("bbu_up", 0,
+		"Whether the last sample could be read from the gauge."),
+	[BQ27x00_OM_INFO] = BQ27x00_OM_GAUGE("bbu_info", 0,
+		"Battery identity, always 1."),
+	[BQ27x00_OM_SOC] = BQ27x00_OM_GAUGE("bbu_state_of_charge_percent", 0,
+		"Relative state of charge."),
+	[BQ27x00_OM_VOLTAGE] = BQ27x00_OM_GAUGE("bbu_voltage_volts", 6,
+		"Battery voltage."),
+	[BQ27x00_OM_CURRENT] = BQ27x00_OM_GAUGE("bbu_current_amperes", 6,
+		"Average current, negative while discharging."),
+	[BQ27x00_OM_POWER] = BQ27x00_OM_GAUGE("bbu_power_watts", 6,
+		"Average power, negative while discharging."),
+	[BQ27x00_OM_TEMP] = BQ27x00_OM_GAUGE("bbu_temperature_celsius", 2,
+		"Battery temperature."),
+	[BQ27x00_OM_TTE] = BQ27x00_OM_GAUGE("bbu_time_to_empty_seconds", 0,
+		"Time to empty at the present current."),
+	[BQ27x00_OM_TTF] = BQ27x00_OM_GAUGE("bbu_time_to_full_seconds", 0,
+		"Time to full at the present current."),
+	[BQ27x00_OM_CHARGE_FULL] = BQ27x00_OM_GAUGE(
+		"bbu_full_charge_capacity_coulombs", 4,
+		"Charge of the full battery."),
+	[BQ27x00_OM_ENERGY] = BQ27x00_OM_GAUGE("bbu_energy_joules", 4,
+		"Remaining energy."),
+	[BQ27x00_OM_CYCLES] = BQ27x00_OM_GAUGE("bbu_cycle_count", 0,
+		"Charge cycles the battery went through."),
+	[BQ27x00_OM_ON_BATTERY] = BQ27x00_OM_GAUGE("bbu_on_battery", 0,
+		"Whether the battery is discharging."),
+	[BQ27x00_OM_FLUSH] = BQ27x00_OM_GAUGE("bbu_flush_budget_bytes", 0,
+		"Data the write-back cache can flush on the remaining energy."),
+	[BQ27x00_OM_SNAPSHOTS] = BQ27x00_OM("bbu_snapshots", "counter",
+		"bbu_snapshots_total", 0, "Snapshots published."),
+};
+
+/* room for the samples of one gauge */
+#define BQ27x00_OM_MAX		2048
+
+/*
+ * What /proc/bbu and /proc/bbu_metrics serve for one gauge, rendered
+ * once per sample. Reads only copy it out. It is replaced under RCU,
+ * so readers never wait for the update cycle.
+ */
+struct bq27x00_render {
+	struct rcu_head rcu;
+	unsigned int proc_len;		/* /proc/bbu block at data */
+	char *om;			/* OpenMetrics samples */
+	unsigned int om_off[BQ27x00_OM_NR + 1];	/* family i at om_off[i] */
+	char data[];
+};
+
+/*
+ * Value of metric i scaled to its family, false if the gauge does not
+ * have it.
+ */
+static bool bq27x00_om_value(struct bq27x00_device_info *di, int i, s64 *val)
+{
+	const struct bq27x00_reg_cache *cache = &di->cache;
+	int v;
+
+	if (i == BQ27x00_OM_UP) {
+		*val = cache->flags >= 0;
+		return true;
+	}
+
+	/* last known values are not worth exporting */
+	if (cache->flags < 0)
+		return false;
+
+	switch (i) {
+	case BQ27x00_OM_SOC:
+		*val = cache->capacity;
+		break;
+	case BQ27x00_OM_VOLTAGE:
+		if (!bq27x00_last_get(di, BQ27x00_LAST_VOLT, &v))
+			return false;
+		*val = v;
+		break;
+	case BQ27x00_OM_CURRENT:
+		if (!bq27x00_last_get(di, BQ27x00_LAST_CURR, &v))
+			return false;
+		*val = v;
+		return true;
+	case BQ27x00_OM_POWER:
+		/* uW, signed */
+		*val = cache->power_avg;
+		return *val != -ENODATA;
+	case BQ27x00_OM_TEMP:
+		if (cache->temperature < 0)
+			return false;
+		*val = cache->temperature * 10LL - 27315;
+		return true;
+	case BQ27x00_OM_TTE:
+		*val = cache->time_to_empty;
+		break;
+	case BQ27x00_OM_TTF:
+		*val = cache->time_to_full;
+		break;
+	case BQ27x00_OM_CHARGE_FULL:
+		if (cache->charge_full < 0)
+			return false;
+		/* uAh to 10^-4 C */
+		*val = cache->charge_full * 36LL;
+		return true;
+	case BQ27x00_OM_ENERGY:
+		if (cache->energy < 0)
+			return false;
+		/* uWh to 10^-4 J */
+		*val = cache->energy * 36LL;
+		return true;
+	case BQ27x00_OM_CYCLES:
+		*val = cache->cycle_count;
+		break;
+	case BQ27x00_OM_ON_BATTERY:
+		*val = !!(cache->flags & BQ27x00_FLAG_DSG);
+		break;
+	case BQ27x00_OM_FLUSH:
+		if (cache->flush_budget < 0)
+			return false;
+		*val = (s64)cache->flush_budget << 20;
+		return true;
+	case BQ27x00_OM_SNAPSHOTS:
+		*val = di->seq;
+		break;
+	default:
+		return false;
+	}
+
+	/* everything else is unsigned, < 0 is -ENODATA */
+	return *val >= 0;
+}
+
+/* Copy at most max characters of s as a label value. */
+static int bq27x00_om_escape(char *buf, int size, const char *s, int max)
+{
+	int len = 0;
+
+	for (; max-- && *s && len + 2 < size; s++) {
+		if (*s == '\\' || *s == '"') {
+			buf[len++] = '\\';
+			buf[len++] = *s;
+		} else if (isprint(*s)) {
+			buf[len++] = *s;
+		}
+	}
+
+	return len;
+}
+
+static int bq27x00_om_sample(struct bq27x00_device_info *di, int i,
+		char *buf, int size)
+{
+	static const u32 scale[] = { 1, 10, 100, 1000, 10000, 100000, 1000000 };
+	const struct bq27x00_om_family *f = &bq27x00_om[i];
+	int len;
+	s64 val;
+	u64 mag;
+	u32 rem;
+
+	if (i == BQ27x00_OM_INFO) {
+		if (!di->desc->ident)
+			return 0;
+		len = scnprintf(buf, size, "%s{device=\"%s\",manufacturer=\"",
+				f->sample, di->bat.name);
+		len += bq27x00_om_escape(buf + len, size - len,
+					 di->ident.manufacturer,
+					 sizeof(di->ident.manufacturer));
+		len += scnprintf(buf + len, size - len, "\",serial=\"");
+		len += bq27x00_om_escape(buf + len, size - len,
+					 di->ident.serial_str,
+					 sizeof(di->ident.serial_str));
+		len += scnprintf(buf + len, size - len, "\"} 1\n");
+		return len;
+	}
+
+	if (!bq27x00_om_value(di, i, &val))
+		return 0;
+
+	len = scnprintf(buf, size, "%s{device=\"%s\"} ", f->sample,
+			di->bat.name);
+	if (!f->decimals)
+		return len + scnprintf(buf + len, size - len, "%lld\n", val);
+
+	mag = val < 0 ? -val : val;
+	rem = do_div(mag, scale[f->decimals]);
+
+	return len + scnprintf(buf + len, size - len, "%s%llu.%0*u\n",
+			       val < 0 ? "-" : "", mag, f->decimals, rem);
+}
+
+/*
+ * Render the text outputs of the current snapshot. Called by the update
+ * cycle with update_lock held, so there is one writer at a time.
+ */
+static void bq27x00_render(struct bq27x00_device_info *di)
+{
+	struct bq27x00_render *r, *old;
+	int i, len = 0;
+
+	r = kmalloc(sizeof(*r) + BBU_PROC_BLOCK_MAX + BQ27x00_OM_MAX,
+		    GFP_KERNEL);
+	if (!r)
+		return;		/* readers keep the previous one */
+
+	r->proc_len = bbu_format_proc(di, r->data, BBU_PROC_BLOCK_MAX);
+	r->om = r->data + r->proc_len;
+	for (i = 0; i < BQ27x00_OM_NR; i++) {
+		r->om_off[i] = len;
+		len += bq27x00_om_sample(di, i, r->om + len,
+					 BQ27x00_OM_MAX - len);
+	}
+	r->om_off[i] = len;
+
+	old = rcu_dereference_protected(di->render,
+					lockdep_is_held(&di->update_lock));
+	rcu_assign_pointer(di->render, r);
+	if (old)
+		kfree_rcu(old, rcu);
+}
+
+/*
+ * /proc/bbu serves the cached snapshots. Writing a number of ms to an
+ * open file sets the max age for reads through that file descriptor,
+ * older snapshots are refreshed from the bus first. -1, the default,
+ * never refreshes.
+ */
+struct bbu_proc_state {
+	int max_age;
+};
+
+static int bbu_proc_show(struct seq_file *m, void *v)
+{
+	struct bbu_proc_state *st = m->private;
+	struct bq27x00_device_info **dis;
+	struct bq27x00_render *r;
+	bool first = true;
+	int i, nr;
+
+	dis = bq27x00_get_devices(&nr);
+	if (!dis)
+		return -ENOMEM;
+
+	/* one block per gauge, separated by an empty line */
+	for (i = 0; i < nr; i++) {
+		bq27x00_refresh(dis[i], st->max_age);
+
+		/* nothing rendered before the first sample */
+		rcu_read_lock();
+		r = rcu_dereference(dis[i]->render);
+		if (r) {
+			if (!first)
+				seq_putc(m, '\n');
+			seq_write(m, r->data, r->proc_len);
+			first = false;
+		}
+		rcu_read_unlock();
+	}
+	bq27x00_put_devices(dis, nr);
+
+	return 0;
+}
+
+static int bbu_proc_open(struct inode *inode, struct file *file)
+{
+	struct bbu_proc_state *st;
+	int ret;
+
+	st = kzalloc(sizeof(*st), GFP_KERNEL);
+	if (!st)
+		return -ENOMEM;
+	st->max_age = -1;
+
+	ret = single_open(file, bbu_proc_show, st);
+	if (ret)
+		kfree(st);
+
+	return ret;
+}
+
+static ssize_t bbu_proc_write(struct file *file, const char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct bbu_proc_state *st =
+		((struct seq_file *)file->private_data)->private;
+	int val, ret;
+
+	ret = kstrtoint_from_user(buf, count, 0, &val);
+	if (ret)
+		return ret;
+
+	st->max_age = val < 0 ? -1 : val;
+
+	return count;
+}
+
+static int bbu_proc_release(struct inode *inode, struct file *file)
+{
+	kfree(((struct seq_file *)file->private_data)->private);
+
+	return single_release(inode, file);
+}
+
+static const struct file_operations bbu_proc_fops = {
+	.owner = THIS_MODULE,
+	.open = bbu_proc_open,
+	.read = seq_read,
+	.write = bbu_proc_write,
+	.llseek = seq_lseek,
+	.release = bbu_proc_release,
+};
+
+/*
+ * /proc/bbu_metrics never touches the bus. The renderings of all gauges
+ * are taken once, so the file is a consistent cut even if a gauge is
+ * sampled meanwhile.
+ */
+static int bbu_metrics_show(struct seq_file *m, void *v)
+{
+	struct bq27x00_device_info *di;
+	struct bq27x00_render **r;
+	int i, k, n = 0;
+
+	mutex_lock(&bq27x00_list_lock);
+	list_for_each_entry(di, &bq27x00_devices, node)
+		n++;
+
+	r = kcalloc(n ? n : 1, sizeof(*r), GFP_KERNEL);
+	if (!r) {
+		mutex_unlock(&bq27x00_list_lock);
+		return -ENOMEM;
+	}
+
+	rcu_read_lock();
+	k = 0;
+	list_for_each_entry(di, &bq27x00_devices, node)
+		r[k++] = rcu_dereference(di->render);
+
+	for (i = 0; i < BQ27x00_OM_NR; i++) {
+		seq_puts(m, bq27x00_om[i].head);
+		for (k = 0; k < n; k++)
+			if (r[k])
+				seq_write(m, r[k]->om + r[k]->om_off[i],
+					  r[k]->om_off[i + 1] - r[k]->om_off[i]);
+	}
+	rcu_read_unlock();
+	mutex_unlock(&bq27x00_list_lock);
+
+	seq_puts(m, "# EOF\n");
+	kfree(r);
+
+	return 0;
+}
+
+static int bbu_metrics_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, bbu_metrics_show, NULL);
+}
+
+static const struct file_operations bbu_metrics_fops = {
+	.owner = THIS_MODULE,
+	.open = bbu_metrics_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+
+#ifdef CONFIG_PM_SLEEP
+/*
+ * Stop polling and wait for a running update before the system sleeps.
+ * A flash stream being programmed is not interrupted, it vetoes the
+ * suspend instead.
+ */
+static int bq27x00_battery_suspend(struct device *dev)
+{
+	struct bq27x00_device_info *di = dev_get_drvdata(dev);
+
+	if (di->flash.active)
+		return -EBUSY;
+
+	mutex_lock(&di->lock);
+	di->suspended = true;
+	mutex_unlock(&di->lock);
+
+	bq27x00_cancel_poll(di);
+	flush_work(&di->at_rate.work);
+
+	return 0;
+}
+
+/*
+ * Resync with one block read before userspace is thawed, so nobody
+ * sees pre-suspend values, and announce the snapshot even if nothing
+ * changed while asleep.
+ */
+static int bq27x00_battery_resume(struct device *dev)
+{
+	struct bq27x00_device_info *di = dev_get_drvdata(dev);
+	unsigned long delay;
+
+	mutex_lock(&di->lock);
+	di->suspended = false;
+	mutex_lock(&di->update_lock);
+	if (di->ready && !bq27x00_update(di)) {
+		power_supply_changed(&di->bat);
+		bq27x00_trace_uevent(di, &di->cache);
+	}
+	mutex_unlock(&di->update_lock);
+	mutex_unlock(&di->lock);
+
+	if (!di->ready)
+		bq27x00_schedule_poll(di, 0);
+	else if (bq27x00_poll_delay(di, &delay))
+		bq27x00_schedule_poll(di, delay);
 
-        /*
-         * We only support reading the whole string at once.
-         */
-        if (size < len)
-                return -EINVAL;
-        /*
-         * If file position is non-zero, then assume the string has
-         * been read and indicate there is no more data to be read.
-         */
-        if (offset != 0)
-                return 0;
-        /*
-         * We know the buffer is big enough to hold the string.
-         */
-        /*
-         * Signal EOF.
-         */
-        *eof = 1;
+	return 0;
+}
+#endif
+
+#ifdef CONFIG_PM_RUNTIME
+/*
+ * The gauge runs on its own; only the path to it is powered down, which
+ * the PM core does through the parent once this device is suspended.
+ * Control and data flash sequences sleep between their bus accesses
+ * and rely on the gauge seeing one uninterrupted conversation, so the
+ * path is kept up while one is in progress.
+ */
+static int bq27x00_battery_runtime_suspend(struct device *dev)
+{
+	struct bq27x00_device_info *di = dev_get_drvdata(dev);
 
-        return len;
+	if (di->flash.active || mutex_is_locked(&di->seq_lock))
+		return -EBUSY;
 
+	return 0;
+}
+
+/*
+ * Nothing to restore on the gauge; the core wants the callback to
+ * power the parent back up before the next access.
+ */
+static int bq27x00_battery_runtime_resume(struct device *dev)
+{
+	return 0;
 }
+#endif
 
+static const struct dev_pm_ops bq27x00_battery_pm_ops = {
+	SET_SYSTEM_SLEEP_PM_OPS(bq27x00_battery_suspend,
+				bq27x00_battery_resume)
+	SET_RUNTIME_PM_OPS(bq27x00_battery_runtime_suspend,
+			   bq27x00_battery_runtime_resume, NULL)
+};
 
 static const struct i2c_device_id bq27x00_id[] = {
 	{ "bq27200", BQ27000 },	/* bq27200 is same as bq27000, but with i2c */
@@ -1058,58 +5983,330 @@ static const struct i2c_device_id bq27x00_id[] = {
 };
 MODULE_DEVICE_TABLE(i2c, bq27x00_id);
 
+/*
+ * The i2c core turns "ti,<chip>" into the client name, so the id table
+ * above still selects the chip for device tree (and ACPI PRP0001)
+ * instantiated gauges.
+ */
+static const struct of_device_id bq27x00_of_match[] = {
+	{ .compatible = "ti,bq27200" },
+	{ .compatible = "ti,bq27500" },
+	{ .compatible = "ti,bq27425" },
+	{ .compatible = "ti,bq34z100" },
+	{},
+};
+MODULE_DEVICE_TABLE(of, bq27x00_of_match);
+
 static struct i2c_driver bq27x00_battery_driver = {
 	.driver = {
 		.name = "bq34z100",
+		.of_match_table = of_match_ptr(bq27x00_of_match),
+		.pm = &bq27x00_battery_pm_ops,
 	},
 	.probe = bq27x00_battery_probe,
 	.remove = bq27x00_battery_remove,
 	.id_table = bq27x00_id,
 };
 
-static struct i2c_board_info i2c_board_info[] = {
-	{
-		I2C_BOARD_INFO("bq34z100", 0x55),
-	},
+/*
+ * Manual instantiation for boards without firmware description.
+ * Without "detect" the gauge is created blindly on every listed
+ * adapter, as the driver always did for adapter 9. With "detect" all
+ * listed adapters are probed at once and only gauges that answer
+ * DEVICE_TYPE with a known value are created; a bus that does not
+ * answer within detect_timeout is given up on.
+ *
+ * 0x55 is also an EEPROM address and those buses carry EEPROMs, so the
+ * DEVICE_TYPE subcommand write only goes out to an address nobody has
+ * claimed and whose standard registers read back like a gauge.
+ */
+#define BQ27x00_I2C_ADDR		0x55
+#define BQ27x00_MAX_ADAPTERS		8
+
+static int adapters[BQ27x00_MAX_ADAPTERS] = { 9 };
+static int num_adapters = 1;
+module_param_array(adapters, int, &num_adapters, 0444);
+MODULE_PARM_DESC(adapters, "i2c adapters to instantiate the gauge on - " \
+				"negative entries are skipped");
+
+static bool detect;
+module_param(detect, bool, 0444);
+MODULE_PARM_DESC(detect, "verify DEVICE_TYPE before instantiating on " \
+				"the listed adapters");
+
+static unsigned int detect_timeout = 500;
+module_param(detect_timeout, uint, 0444);
+MODULE_PARM_DESC(detect_timeout, "detection time limit in milliseconds");
+
+static const struct {
+	u16 device_type;
+	const char *name;
+} bq27x00_detect_types[] = {
+	{ 0x0100, "bq34z100" },
+	{ 0x0500, "bq27500" },
+	{ 0x0425, "bq27425" },
+};
+
+/* StateOfCharge() and Temperature() of the detectable register maps */
+static const struct {
+	u8 soc;
+	u8 temp;
+	bool max_error;		/* SOC is a byte, MaxError() follows it */
+} bq27x00_detect_maps[] = {
+	{ BQ27x00_REG_SOC, BQ27x00_REG_TEMP, true },	/* bq34z100 */
+	{ BQ27500_REG_SOC, BQ27000_REG_TEMP, false },	/* bq27500 */
+	{ BQ27425_REG_SOC, BQ27425_REG(BQ27000_REG_TEMP), false },
 };
 
-static struct i2c_client *client;
+/* plausible Temperature() in 0.1 K, -50 to 100 C */
+#define BQ27x00_DETECT_TEMP_MIN		2231
+#define BQ27x00_DETECT_TEMP_MAX		3731
 
-static inline int bq27x00_battery_i2c_init(void)
+struct bq27x00_scan {
+	struct work_struct work;
+	struct completion done;
+	atomic_t refs;		/* scanner and waiter */
+	int nr;
+	const char *name;	/* detected chip, NULL if none */
+};
+
+static struct i2c_client *clients[BQ27x00_MAX_ADAPTERS];
+static struct workqueue_struct *bq27x00_scan_wq;
+
+static void bq27x00_scan_put(struct bq27x00_scan *scan)
+{
+	if (atomic_dec_and_test(&scan->refs))
+		kfree(scan);
+}
+
+static int bq27x00_detect_busy(struct device *dev, void *addr)
+{
+	struct i2c_client *client = i2c_verify_client(dev);
+
+	return client && client->addr == *(unsigned short *)addr ? -EBUSY : 0;
+}
+
+/*
+ * Read-only check that something at 0x55 looks like a gauge: the SOC
+ * and the temperature of one of the known maps are in range. On the
+ * bq34z100 the word at StateOfCharge() carries MaxError(), 1 to 100 %,
+ * in its high byte.
+ */
+static bool bq27x00_detect_sane(struct i2c_adapter *adapter)
+{
+	union i2c_smbus_data soc, temp;
+	unsigned int err;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(bq27x00_detect_maps); i++) {
+		if (i2c_smbus_xfer(adapter, BQ27x00_I2C_ADDR, 0, I2C_SMBUS_READ,
+				   bq27x00_detect_maps[i].soc,
+				   I2C_SMBUS_WORD_DATA, &soc) < 0 ||
+		    i2c_smbus_xfer(adapter, BQ27x00_I2C_ADDR, 0, I2C_SMBUS_READ,
+				   bq27x00_detect_maps[i].temp,
+				   I2C_SMBUS_WORD_DATA, &temp) < 0)
+			return false;	/* nobody there */
+
+		if (bq27x00_detect_maps[i].max_error) {
+			err = soc.word >> 8;
+			if (err < 1 || err > 100)
+				continue;
+			soc.word &= 0xff;
+		}
+
+		if (soc.word <= 100 &&
+		    temp.word >= BQ27x00_DETECT_TEMP_MIN &&
+		    temp.word <= BQ27x00_DETECT_TEMP_MAX)
+			return true;
+	}
+
+	return false;
+}
+
+static void bq27x00_scan_adapter(struct work_struct *work)
 {
+	struct bq27x00_scan *scan = container_of(work, struct bq27x00_scan,
+						 work);
 	struct i2c_adapter *adapter;
-	
-	int ret = i2c_add_driver(&bq27x00_battery_driver);
-	if (ret)
-		printk(KERN_ERR "Unable to register BQ27x00 i2c driver\n");
+	union i2c_smbus_data data;
+	unsigned short addr;
+	int i, ret;
 
-	adapter = i2c_get_adapter(9);
+	adapter = i2c_get_adapter(scan->nr);
 	if (!adapter)
-		return -ENODEV;
+		goto out;
+
+	if (!i2c_check_functionality(adapter, I2C_FUNC_SMBUS_WORD_DATA))
+		goto put;
+
+	addr = BQ27x00_I2C_ADDR;
+	if (device_for_each_child(&adapter->dev, &addr, bq27x00_detect_busy)) {
+		pr_info("bq34z100: i2c-%d: 0x%02x already in use\n", scan->nr,
+			addr);
+		goto put;
+	}
+
+	if (!bq27x00_detect_sane(adapter))
+		goto put;
+
+	data.word = DEV_TYPE_SUBCMD;
+	ret = i2c_smbus_xfer(adapter, BQ27x00_I2C_ADDR, 0, I2C_SMBUS_WRITE,
+			     CONTROL_CMD, I2C_SMBUS_WORD_DATA, &data);
+	if (ret < 0)
+		goto put;
+
+	msleep(10);
+
+	ret = i2c_smbus_xfer(adapter, BQ27x00_I2C_ADDR, 0, I2C_SMBUS_READ,
+			     CONTROL_CMD, I2C_SMBUS_WORD_DATA, &data);
+	if (ret < 0)
+		goto put;
 
-	client = i2c_new_device(adapter, i2c_board_info);
+	for (i = 0; i < ARRAY_SIZE(bq27x00_detect_types); i++)
+		if (bq27x00_detect_types[i].device_type == data.word)
+			scan->name = bq27x00_detect_types[i].name;
 
+	if (!scan->name)
+		pr_info("bq34z100: unknown device type 0x%04x on i2c-%d\n",
+			data.word, scan->nr);
+put:
 	i2c_put_adapter(adapter);
+out:
+	complete(&scan->done);
+	bq27x00_scan_put(scan);
+}
 
-	if (!client)
-		return -ENODEV;
+static struct i2c_client *bq27x00_new_client(int nr, const char *name)
+{
+	struct i2c_board_info info = {
+		I2C_BOARD_INFO("bq34z100", BQ27x00_I2C_ADDR),
+	};
+	struct i2c_adapter *adapter;
+	struct i2c_client *client;
+
+	adapter = i2c_get_adapter(nr);
+	if (!adapter)
+		return NULL;
+
+	strlcpy(info.type, name, sizeof(info.type));
+	client = i2c_new_device(adapter, &info);
+
+	i2c_put_adapter(adapter);
+
+	return client;
+}
+
+static void bq27x00_detect_adapters(void)
+{
+	struct bq27x00_scan *scans[BQ27x00_MAX_ADAPTERS] = { NULL, };
+	unsigned long deadline;
+	long left;
+	int i;
+
+	for (i = 0; i < num_adapters; i++) {
+		if (adapters[i] < 0)
+			continue;
+
+		scans[i] = kzalloc(sizeof(*scans[i]), GFP_KERNEL);
+		if (!scans[i])
+			continue;
+
+		INIT_WORK(&scans[i]->work, bq27x00_scan_adapter);
+		init_completion(&scans[i]->done);
+		atomic_set(&scans[i]->refs, 2);
+		scans[i]->nr = adapters[i];
+		queue_work(bq27x00_scan_wq, &scans[i]->work);
+	}
+
+	/* all buses are probed in parallel, one shared deadline */
+	deadline = jiffies + msecs_to_jiffies(detect_timeout);
+
+	for (i = 0; i < num_adapters; i++) {
+		if (!scans[i])
+			continue;
+
+		left = deadline - jiffies;
+		if (left > 0)
+			left = wait_for_completion_timeout(&scans[i]->done,
+							   left);
+		else
+			left = completion_done(&scans[i]->done);
 
-        if (create_proc_read_entry("bbu", 0, NULL, bbu_read_proc,
-                                    NULL) == 0){
+		if (!left)
+			pr_warn("bq34z100: i2c-%d: detection timed out\n",
+				scans[i]->nr);
+		else if (scans[i]->name)
+			clients[i] = bq27x00_new_client(scans[i]->nr,
+							scans[i]->name);
+
+		bq27x00_scan_put(scans[i]);
+	}
+}
+
+static void bq27x00_remove_clients(void)
+{
+	int i;
+
+	for (i = 0; i < BQ27x00_MAX_ADAPTERS; i++)
+		if (clients[i])
+			i2c_unregister_device(clients[i]);
+	i2c_del_driver(&bq27x00_battery_driver);
+
+	/* waits for scans that outlived detect_timeout */
+	if (bq27x00_scan_wq)
+		destroy_workqueue(bq27x00_scan_wq);
+}
+
+static inline int bq27x00_battery_i2c_init(void)
+{
+	int i;
+
+	int ret = i2c_add_driver(&bq27x00_battery_driver);
+	if (ret) {
+		printk(KERN_ERR "Unable to register BQ27x00 i2c driver\n");
+		return ret;
+	}
+
+	if (detect) {
+		bq27x00_scan_wq = alloc_workqueue("bq27x00_scan", WQ_UNBOUND,
+						  BQ27x00_MAX_ADAPTERS);
+		if (!bq27x00_scan_wq) {
+			i2c_del_driver(&bq27x00_battery_driver);
+			return -ENOMEM;
+		}
+		bq27x00_detect_adapters();
+	} else {
+		for (i = 0; i < num_adapters; i++) {
+			if (adapters[i] < 0)
+				continue;
+			clients[i] = bq27x00_new_client(adapters[i], "bq34z100");
+			if (!clients[i])
+				pr_warn("bq34z100: cannot instantiate on i2c-%d\n",
+					adapters[i]);
+		}
+	}
+
+        if (proc_create("bbu", S_IRUGO | S_IWUSR, NULL,
+                        &bbu_proc_fops) == NULL) {
                 printk(KERN_ERR
                        "Unable to register \"bbu\" proc file\n");
                 
+		bq27x00_remove_clients();
 		return -ENOMEM;
         }
 
+	/* the exposition is an extra, /proc/bbu is what users rely on */
+	if (!proc_create("bbu_metrics", S_IRUGO, NULL, &bbu_metrics_fops))
+		pr_warn("bq34z100: unable to register \"bbu_metrics\" proc file\n");
+
 	return ret;
 }
 
 static inline void bq27x00_battery_i2c_exit(void)
 {
-	i2c_del_driver(&bq27x00_battery_driver);
-	i2c_unregister_device(client);
+	remove_proc_entry("bbu_metrics", NULL);
 	remove_proc_entry("bbu", NULL);
+	bq27x00_remove_clients();
 	
 	printk("BBU driver exit.\n");
 }
@@ -1122,9 +6319,35 @@ static int __init bq27x00_battery_init(void)
 {
 	int ret;
 
+	/* debugfs and netlink are optional, the rest works without them */
+	bq27x00_debugfs_root = debugfs_create_dir("bq34z100", NULL);
+	if (IS_ERR_OR_NULL(bq27x00_debugfs_root))
+		bq27x00_debugfs_root = NULL;
+	bq27x00_genl_init();
+	bq27x00_pack_init();
+
+	if (poll_shared) {
+		bq27x00_shared_worker = bq27x00_worker_create("bq34z100");
+		if (IS_ERR(bq27x00_shared_worker)) {
+			ret = PTR_ERR(bq27x00_shared_worker);
+			bq27x00_shared_worker = NULL;
+			goto err_worker;
+		}
+	}
+
 	ret = bq27x00_battery_i2c_init();
 	if (ret)
-		return ret;
+		goto err_i2c;
+
+	return 0;
+
+err_i2c:
+	if (bq27x00_shared_worker)
+		bq27x00_worker_destroy(bq27x00_shared_worker);
+err_worker:
+	bq27x00_pack_exit();
+	bq27x00_genl_exit();
+	debugfs_remove_recursive(bq27x00_debugfs_root);
 
 	return ret;
 }
@@ -1133,6 +6356,11 @@ module_init(bq27x00_battery_init);
 static void __exit bq27x00_battery_exit(void)
 {
 	bq27x00_battery_i2c_exit();
+	if (bq27x00_shared_worker)
+		bq27x00_worker_destroy(bq27x00_shared_worker);
+	bq27x00_pack_exit();
+	bq27x00_genl_exit();
+	debugfs_remove_recursive(bq27x00_debugfs_root);
 }
 module_exit(bq27x00_battery_exit);
 
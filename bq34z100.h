@@ -0,0 +1,200 @@
+/*
+ * BQ34Z100 battery driver - in-kernel consumer interface
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ */
+
+#ifndef __BQ34Z100_H__
+#define __BQ34Z100_H__
+
+#include <linux/types.h>
+#include <linux/bitops.h>
+#include <linux/notifier.h>
+
+/*
+ * Snapshot of the gauge registers taken by one update cycle.
+ * Units follow the power_supply class (uAh, uWh, seconds), temperature
+ * is in tenths of degree Kelvin, a negative value means "not available";
+ * signed fields use -ENODATA for that.
+ */
+struct bq27x00_reg_cache {
+	int temperature;
+	int time_to_empty;
+	int time_to_empty_avg;
+	int time_to_full;
+	int charge_full;
+	int cycle_count;
+	int capacity;
+	int energy;
+	int flags;
+	int power_avg;		/* uW, signed, negative while discharging */
+	int health;
+	int flush_budget; /* MiB the write-back cache can flush on battery */
+
+	/* extended metrics, bq34z100 only */
+	int state_of_health;	/* % */
+	int internal_temp;	/* 0.1K, gauge die */
+	int charge_voltage;	/* uV requested from the charger */
+	int charge_current;	/* uA requested from the charger */
+	int max_load_current;	/* uA, signed */
+	int max_load_tte;	/* seconds at max_load_current */
+	int standby_current;	/* uA, signed */
+	int standby_tte;	/* seconds at standby_current */
+	int passed_charge;	/* uAh since the last reset, signed */
+	int remaining_capacity;	/* uAh */
+};
+
+/* Event bits, passed as the notifier action (several may be set at once) */
+#define BQ27x00_EVT_ON_BATTERY		BIT(0) /* DSG set: running on battery */
+#define BQ27x00_EVT_AC_RESTORED		BIT(1) /* DSG cleared */
+#define BQ27x00_EVT_SOC1		BIT(2) /* SOC1 threshold crossed */
+#define BQ27x00_EVT_SOCF		BIT(3) /* SOCF (final) threshold crossed */
+#define BQ27x00_EVT_BATLOW		BIT(4) /* battery low voltage */
+#define BQ27x00_EVT_OVERTEMP		BIT(5) /* OTC or OTD raised */
+#define BQ27x00_EVT_ABSENT		BIT(6) /* gauge stopped answering */
+#define BQ27x00_EVT_PRESENT		BIT(7) /* gauge answering again */
+#define BQ27x00_EVT_FLUSH_BUDGET	BIT(8) /* flush_budget changed */
+
+struct bq27x00_event_data {
+	int id;				/* battery instance number */
+	const char *name;		/* power supply name */
+	const struct bq27x00_reg_cache *cache;	/* snapshot that raised it */
+	u64 timestamp;			/* CLOCK_MONOTONIC ns of the sample */
+	u32 seq;			/* publish sequence number */
+};
+
+/*
+ * A snapshot with its freshness, as read from the "snapshot" sysfs
+ * attribute. timestamp is CLOCK_MONOTONIC ns of the last sample, seq is
+ * bumped every time a changed snapshot is published.
+ *
+ * The layout is fixed and does not follow struct bq27x00_reg_cache.
+ * New fields are only ever appended, with size growing to match, and
+ * version changes only if an existing field changes meaning. Readers
+ * check version and use at most size bytes.
+ */
+#define BQ27x00_SNAPSHOT_VERSION	1
+
+struct bq27x00_snapshot {
+	__u32 version;		/* BQ27x00_SNAPSHOT_VERSION */
+	__u32 size;		/* bytes in this record */
+	__u64 timestamp;
+	__u32 seq;
+	__s32 temperature;
+	__s32 time_to_empty;
+	__s32 time_to_empty_avg;
+	__s32 time_to_full;
+	__s32 charge_full;
+	__s32 cycle_count;
+	__s32 capacity;
+	__s32 energy;
+	__s32 flags;
+	__s32 power_avg;
+	__s32 health;
+	__s32 flush_budget;
+	__s32 state_of_health;
+	__s32 internal_temp;
+	__s32 charge_voltage;
+	__s32 charge_current;
+	__s32 max_load_current;
+	__s32 max_load_tte;
+	__s32 standby_current;
+	__s32 standby_tte;
+	__s32 passed_charge;
+	__s32 remaining_capacity;
+	__u32 reserved;		/* zero */
+};
+
+/*
+ * Notifier callbacks run in process context from the driver's update
+ * path, with the snapshot already published. They must not call back
+ * into the driver and should only kick off work (e.g. switch a cache
+ * to write-through), not block for long.
+ */
+int bq27x00_register_notifier(struct notifier_block *nb);
+int bq27x00_unregister_notifier(struct notifier_block *nb);
+
+/*
+ * Bus trace, as read from and written to debugfs <name>/trace/data
+ *
+ * A trace is a sequence of records in host byte order. Bulk records
+ * are followed by value bytes of payload (zeroes for a failed read).
+ */
+enum {
+	BQ27x00_TRACE_READ_BYTE,
+	BQ27x00_TRACE_READ_WORD,
+	BQ27x00_TRACE_WRITE_BYTE,
+	BQ27x00_TRACE_WRITE_WORD,
+	BQ27x00_TRACE_READ_BULK,
+	BQ27x00_TRACE_WRITE_BULK,
+};
+
+struct bq27x00_trace_rec {
+	__u64 ts;	/* ns since the capture started */
+	__s32 result;	/* value read, 0 or -errno */
+	__u16 value;	/* value written, or bulk length */
+	__u8 op;	/* BQ27x00_TRACE_* */
+	__u8 reg;
+};
+
+/*
+ * Generic netlink interface
+ *
+ * Every published snapshot is multicast to the "events" group of the
+ * "bq27x00" family as a BQ27x00_CMD_SNAPSHOT message; the events it
+ * raised (BQ27x00_EVT_*) come along in BQ27x00_ATTR_EVENTS. A dump of
+ * BQ27x00_CMD_GET returns the current snapshot of every gauge. Gauges
+ * older than BQ27x00_ATTR_MAX_AGE, if it is given, are sampled after the
+ * reply; the fresh snapshot follows as a multicast if it changed.
+ * BQ27x00_CMD_AT_RATE with BQ27x00_ATTR_ID and BQ27x00_ATTR_AT_RATE
+ * asks a gauge for the time to empty at that rate. The reply carries
+ * BQ27x00_ATTR_AT_RATE_TTE if the driver knows it already; if not, the
+ * gauge is asked and its answer is multicast to the "events" group as
+ * a BQ27x00_CMD_AT_RATE message about a second later.
+ * Signed values are carried in u32 attributes.
+ */
+#define BQ27x00_GENL_NAME		"bq27x00"
+#define BQ27x00_GENL_VERSION		1
+#define BQ27x00_GENL_MCGRP		"events"
+
+enum {
+	BQ27x00_CMD_UNSPEC,
+	BQ27x00_CMD_GET,		/* dump request */
+	BQ27x00_CMD_SNAPSHOT,		/* dump reply and multicast */
+	BQ27x00_CMD_AT_RATE,		/* request and reply */
+	__BQ27x00_CMD_MAX,
+};
+#define BQ27x00_CMD_MAX (__BQ27x00_CMD_MAX - 1)
+
+enum {
+	BQ27x00_ATTR_UNSPEC,
+	BQ27x00_ATTR_ID,		/* u32 */
+	BQ27x00_ATTR_NAME,		/* string */
+	BQ27x00_ATTR_EVENTS,		/* u32, multicast only */
+	BQ27x00_ATTR_FLAGS,
+	BQ27x00_ATTR_CAPACITY,
+	BQ27x00_ATTR_TEMP,
+	BQ27x00_ATTR_TIME_TO_EMPTY,
+	BQ27x00_ATTR_TIME_TO_EMPTY_AVG,
+	BQ27x00_ATTR_TIME_TO_FULL,
+	BQ27x00_ATTR_CHARGE_FULL,
+	BQ27x00_ATTR_CYCLE_COUNT,
+	BQ27x00_ATTR_ENERGY,
+	BQ27x00_ATTR_POWER_AVG,
+	BQ27x00_ATTR_HEALTH,
+	BQ27x00_ATTR_FLUSH_BUDGET,
+	BQ27x00_ATTR_TIMESTAMP,		/* u64, CLOCK_MONOTONIC ns of the sample */
+	BQ27x00_ATTR_SEQ,		/* u32, publish sequence number */
+	BQ27x00_ATTR_MAX_AGE,		/* u32 ms, in BQ27x00_CMD_GET */
+	BQ27x00_ATTR_AT_RATE,		/* s32 mA, < 0 discharging */
+	BQ27x00_ATTR_AT_RATE_TTE,	/* s32 seconds, -ENODATA if not draining,
+					 * -errno in a multicast if the gauge
+					 * could not be asked */
+	__BQ27x00_ATTR_MAX,
+};
+#define BQ27x00_ATTR_MAX (__BQ27x00_ATTR_MAX - 1)
+
+#endif /* __BQ34Z100_H__ */